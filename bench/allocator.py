@@ -0,0 +1,78 @@
+#!/usr/bin/python3
+# Copyright 2023 Bas Wijnen <wijnen@debian.org> {{{
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Affero General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Affero General Public License for more details.
+#
+# You should have received a copy of the GNU Affero General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+# }}}
+
+'''Benchmark for the slab allocator against the system allocator.
+
+Runs an allocation-heavy Lua script (short strings, small tables, closures
+with upvalues) in one or more Lua instances at the same time, one thread per
+instance. Lua code runs without the GIL, so with several threads the
+instances compete only for the memory allocator. The script reports the best
+wall time for each allocator and thread count.
+
+Usage: bench/allocator.py [iterations [max_threads [repeats]]]
+'''
+
+import sys
+import time
+import threading
+import lua
+
+script = '''
+local keep = {}
+for i = 1, n do
+	local s = 'key' .. i
+	local t = {s, i, x = i}
+	local f = function() return t end
+	keep[i % 64 + 1] = {f, s}
+end
+'''
+
+def measure(slab, threads, n, repeats): # {{{
+	'Return the best time in seconds for running the script in parallel in threads new instances.'
+	best = None
+	for r in range(repeats):
+		states = [lua.Lua(slab_allocator = slab) for t in range(threads)]
+		workers = [threading.Thread(target = state.run, args = (script,), kwargs = {'var': 'n', 'value': n}) for state in states]
+		start = time.perf_counter()
+		for worker in workers:
+			worker.start()
+		for worker in workers:
+			worker.join()
+		t = time.perf_counter() - start
+		if best is None or t < best:
+			best = t
+	return best
+# }}}
+
+def main(): # {{{
+	n = int(sys.argv[1]) if len(sys.argv) > 1 else 200000
+	max_threads = int(sys.argv[2]) if len(sys.argv) > 2 else 8
+	repeats = int(sys.argv[3]) if len(sys.argv) > 3 else 5
+
+	print('%-8s %12s %12s %8s' % ('threads', 'malloc', 'slab', 'speedup'))
+	threads = 1
+	while threads <= max_threads:
+		system = measure(False, threads, n, repeats)
+		slab = measure(True, threads, n, repeats)
+		print('%-8d %10.1f ms %10.1f ms %7.2fx' % (threads, system * 1e3, slab * 1e3, system / slab))
+		threads *= 2
+# }}}
+
+if __name__ == '__main__':
+	main()
+
+# vim: set foldmethod=marker :
@@ -0,0 +1,139 @@
+#!/usr/bin/python3
+# Copyright 2023 Bas Wijnen <wijnen@debian.org> {{{
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Affero General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Affero General Public License for more details.
+#
+# You should have received a copy of the GNU Affero General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+# }}}
+
+'''Benchmark suite for the boundary between Python and Lua, using pyperf.
+
+The same benchmarks run against the C extension (src-c) and the ctypes
+backend (src/lua), so results of both, and of different commits, can be
+compared with "python3 -m pyperf compare_to". Select the backend by putting
+the directory that contains it first on the module path with --path:
+
+	bench/boundary.py --path src-c/build/lib.linux-x86_64-cpython-311 -o c.json
+	bench/boundary.py --path src -o ctypes.json
+	python3 -m pyperf compare_to ctypes.json c.json
+
+Without --path, whichever lua module is found first is used. Use
+--benchmarks with a comma separated list of name prefixes to run a subset.
+'''
+
+import sys
+import time
+import pyperf
+
+def add_cmdline_args(cmd, args): # {{{
+	'Pass our options on to the worker processes.'
+	if args.path:
+		cmd.extend(('--path', args.path))
+	if args.benchmarks:
+		cmd.extend(('--benchmarks', args.benchmarks))
+# }}}
+
+# Benchmark functions. Every function gets the number of loops and returns the elapsed time. {{{
+def time_construct(loops, lua): # {{{
+	start = time.perf_counter()
+	for _ in range(loops):
+		lua.Lua()
+	return time.perf_counter() - start
+# }}}
+
+def time_run(loops, code, script): # {{{
+	start = time.perf_counter()
+	for _ in range(loops):
+		code.run(script)
+	return time.perf_counter() - start
+# }}}
+
+def time_call(loops, function, args): # {{{
+	start = time.perf_counter()
+	for _ in range(loops):
+		function(*args)
+	return time.perf_counter() - start
+# }}}
+
+def time_method(loops, method): # {{{
+	start = time.perf_counter()
+	for _ in range(loops):
+		method()
+	return time.perf_counter() - start
+# }}}
+
+def time_module(loops, code, contents): # {{{
+	start = time.perf_counter()
+	for i in range(loops):
+		code.module('bench', contents)
+	return time.perf_counter() - start
+# }}}
+# }}}
+
+def main(): # {{{
+	runner = pyperf.Runner(add_cmdline_args = add_cmdline_args)
+	runner.argparser.add_argument('--path', help = 'directory to import the lua module from')
+	runner.argparser.add_argument('--benchmarks', help = 'comma separated list of benchmark name prefixes to run')
+	args = runner.parse_args()
+	if args.path:
+		sys.path.insert(0, args.path)
+	import lua
+	runner.metadata['lua_backend'] = lua.__file__
+	selected = args.benchmarks.split(',') if args.benchmarks else None
+
+	def bench(name, *args, inner_loops = None):
+		if selected is None or any(name.startswith(prefix) for prefix in selected):
+			runner.bench_time_func(name, *args, inner_loops = inner_loops)
+
+	code = lua.Lua()
+
+	# State construction and running code.
+	bench('construct', time_construct, lua)
+	bench('run_trivial', time_run, code, 'return 1')
+	bench('run_loop', time_run, code, 'local s = 0 for i = 1, 1000 do s = s + i end return s')
+
+	# Calls with 0 to 8 arguments.
+	count = code.run('return function(...) return select("#", ...) end')
+	for n in range(9):
+		bench('call_%d_args' % n, time_call, count, tuple(range(n)))
+
+	# Callbacks from Lua into Python; one benchmark loop runs 100 callbacks.
+	code.run(var = 'callback', value = lambda x: x)
+	callbacks = code.run('return function() for i = 1, 100 do callback(i) end end')
+	bench('callback', time_call, callbacks, (), inner_loops = 100)
+
+	# Conversions per type: push passes a value to a Lua function that ignores it, to_python returns a value.
+	sink = code.run('return function(x) end')
+	values = (('nil', None), ('boolean', True), ('integer', 12345), ('float', 1.5), ('string', 'a short string'),
+			('table', code.run('return {}')), ('function', sink), ('object', object()))
+	for name, value in values:
+		bench('push_' + name, time_call, sink, (value,))
+	for name, source in (('nil', 'nil'), ('boolean', 'true'), ('integer', '12345'), ('float', '1.5'),
+			('string', '"a short string"'), ('table', '{}'), ('function', 'print')):
+		bench('to_python_' + name, time_call, code.run('local v = %s return function() return v end' % source), ())
+
+	# Converting whole tables.
+	size = 10
+	while size <= 10 ** 6:
+		table = code.run('local t = {} for i = 1, n do t[i] = i end return t', var = 'n', value = size)
+		bench('table_list_%d' % size, time_method, table.list)
+		bench('table_dict_%d' % size, time_method, table.dict)
+		size *= 10
+
+	# Providing a module with 100 members.
+	bench('load_module', time_module, code, {'name%d' % i: i for i in range(100)})
+# }}}
+
+if __name__ == '__main__':
+	main()
+
+# vim: set foldmethod=marker :
@@ -0,0 +1,85 @@
+#!/usr/bin/python3
+# Copyright 2023 Bas Wijnen <wijnen@debian.org> {{{
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Affero General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Affero General Public License for more details.
+#
+# You should have received a copy of the GNU Affero General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+# }}}
+
+
+'''Memory footprint of objects that cross the boundary between Python and Lua.
+
+Creates many Table and Function handles in Python, and many Python objects
+in Lua, and reports the memory that each one costs. Python memory is measured
+with tracemalloc, Lua memory with Lua.memory_stats(). The Lua side includes
+the registry slot that keeps a handled value alive, but not the value itself.
+
+Usage: bench/footprint.py [count]
+'''
+
+import sys
+import gc
+import tracemalloc
+import lua
+
+def measure(code, n, make): # {{{
+	'''Return Python and Lua bytes per object for n objects.
+	code must return a Lua function; it can use n. The function is passed to make(), together with a list of n items
+	in which it can keep the objects that it creates.'''
+	state = lua.Lua()
+	function = state.run(code, var = 'n', value = n)
+	keep = [None] * n
+	gc.collect()
+	state.run('collectgarbage()')
+	tracemalloc.start()
+	python_before = tracemalloc.get_traced_memory()[0]
+	lua_before = state.memory_stats()['current']
+	make(function, keep)
+	python_bytes = tracemalloc.get_traced_memory()[0] - python_before
+	lua_bytes = state.memory_stats()['current'] - lua_before
+	tracemalloc.stop()
+	return python_bytes / n, lua_bytes / n
+# }}}
+
+def handles(function, keep): # {{{
+	'Call function once for every item in keep and store the results there.'
+	for i in range(len(keep)):
+		keep[i] = function()
+# }}}
+
+def userdata(function, keep): # {{{
+	'Pass the same Python object to function once for every item in keep.'
+	obj = object()
+	for i in range(len(keep)):
+		function(obj)
+# }}}
+
+# Lua values for each kind of object. Tables and functions are created beforehand, so only the handle is measured.
+cases = (
+	('Table', handles, 'local t = {} return function() return t end'),
+	('Function', handles, 'local f = function() end return function() return f end'),
+	# Lua keeps the userdata in a preallocated array, so this is the cost of the userdata itself.
+	('userdata', userdata, 'local keep = {} for i = 1, n do keep[i] = false end local i = 0 return function(x) i = i + 1 keep[i] = x end'),
+)
+
+def main(): # {{{
+	n = int(sys.argv[1]) if len(sys.argv) > 1 else 100000
+	print('%-10s %14s %14s %14s' % ('object', 'Python bytes', 'Lua bytes', 'total bytes'))
+	for name, make, code in cases:
+		python_bytes, lua_bytes = measure(code, n, make)
+		print('%-10s %14.1f %14.1f %14.1f' % (name, python_bytes, lua_bytes, python_bytes + lua_bytes))
+# }}}
+
+if __name__ == '__main__':
+	main()
+
+# vim: set foldmethod=marker :
@@ -0,0 +1,72 @@
+#!/usr/bin/python3
+# Copyright 2023 Bas Wijnen <wijnen@debian.org> {{{
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Affero General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Affero General Public License for more details.
+#
+# You should have received a copy of the GNU Affero General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+# }}}
+
+'''Microbenchmark for calls from Lua into Python through userdata metamethods.
+
+Every operator and call on a Python object from Lua goes through the
+metamethod callback, so its fixed overhead is paid once per crossing. This
+script reports the time per crossing, with the cost of the Lua loop itself
+subtracted. Run it against builds before and after a change to the callback
+to see the per-call difference; select a build by putting its directory first
+in PYTHONPATH. The script only passes code, var and value to run(), so it also
+works with older builds and with the ctypes backend.
+
+Usage: bench/metamethod.py [iterations [repeats]]
+'''
+
+import sys
+import time
+import lua
+
+class Obj: # {{{
+	def __add__(self, other):
+		return other
+	def __call__(self, *args):
+		return None
+# }}}
+
+def measure(code, script, n, repeats): # {{{
+	'Return the best time in seconds for running script, which loops n times.'
+	best = None
+	for r in range(repeats):
+		start = time.perf_counter()
+		code.run(script, var = 'n', value = n)
+		t = time.perf_counter() - start
+		if best is None or t < best:
+			best = t
+	return best
+# }}}
+
+def main(): # {{{
+	n = int(sys.argv[1]) if len(sys.argv) > 1 else 1000000
+	repeats = int(sys.argv[2]) if len(sys.argv) > 2 else 5
+
+	code = lua.Lua()
+	code.run('', var = 'obj', value = Obj())
+
+	empty = measure(code, 'local x = 0 for i = 1, n do x = x + i end', n, repeats)
+	for name, script in (
+			('__add', 'local x = 0 for i = 1, n do x = obj + i end'),
+			('__call', 'for i = 1, n do obj(i) end')):
+		t = measure(code, script, n, repeats)
+		print('%-8s %8.1f ns/call' % (name, (t - empty) / n * 1e9))
+# }}}
+
+if __name__ == '__main__':
+	main()
+
+# vim: set foldmethod=marker :
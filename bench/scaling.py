@@ -0,0 +1,146 @@
+#!/usr/bin/python3
+# Copyright 2023 Bas Wijnen <wijnen@debian.org> {{{
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Affero General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Affero General Public License for more details.
+#
+# You should have received a copy of the GNU Affero General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+# }}}
+
+'''Multi-core scaling and tail latency benchmark.
+
+Drives N threads against M Lua instances and records the latency of every
+operation in a log-linear (HDR style) histogram. For every thread count it
+reports the throughput, the scaling efficiency (throughput divided by N times
+the single thread throughput), and the p50, p99 and p99.9 latencies. The single
+thread configuration is always measured first, also when it is not listed.
+
+Lua code runs without the GIL and every instance has its own lock, so threads
+that use separate instances run in parallel, while threads that share an
+instance take turns. Scenarios keep different kinds of load apart:
+
+	cpu		pure Lua computation
+	gc		allocation heavy Lua code, so garbage collection pauses show up
+	conversion	passing Python lists in and converting Lua tables back
+
+Operations are either calls of a Lua Function (--api call) or run() of a
+chunk (--api run).
+
+Usage: bench/scaling.py [--threads 1,2,4,8] [--states M] [--duration S]
+	[--scenarios cpu,gc,conversion] [--api call|run]
+'''
+
+import argparse
+import threading
+import time
+import lua
+
+scenarios = { # {{{
+	'cpu': ('local n = ... local s = 0 for i = 1, n do s = s + i % 7 end return s', 2000),
+	'gc': ('local n = ... local t for i = 1, n do t = {i, tostring(i), {i}} end return #t', 200),
+	'conversion': ('local data = ... local t = {} for i, v in ipairs(data) do t[i] = v * 2 end return t', list(range(100))),
+} # }}}
+
+class Histogram: # {{{
+	'Log-linear histogram of nanosecond values, with 2**sub_bits buckets per power of two (under 1% error).'
+	sub_bits = 7
+	def __init__(self):
+		self.counts = {}
+		self.total = 0
+	def record(self, value):
+		shift = max(0, value.bit_length() - self.sub_bits - 1)
+		key = (shift, value >> shift)
+		self.counts[key] = self.counts.get(key, 0) + 1
+		self.total += 1
+	def merge(self, other):
+		for key, count in other.counts.items():
+			self.counts[key] = self.counts.get(key, 0) + count
+		self.total += other.total
+	def percentile(self, p):
+		'Return the upper bound of the bucket that contains the p-th percentile.'
+		target = self.total * p / 100
+		seen = 0
+		for shift, base in sorted(self.counts, key = lambda k: k[1] << k[0]):
+			seen += self.counts[(shift, base)]
+			if seen >= target:
+				return (base + 1) << shift
+		return 0
+# }}}
+
+def worker(code, scenario, api, stop, histogram, counts, index): # {{{
+	source, argument = scenarios[scenario]
+	if api == 'call':
+		function = code.run('return function(...) ' + source + ' end')
+		operation = lambda: function(argument)
+	else:
+		# run() goes through the compiled chunk cache, so this measures the call overhead of run().
+		chunk = 'return (function(...) ' + source + ' end)(arg)'
+		operation = lambda: code.run(chunk, var = 'arg', value = argument)
+	clock = time.perf_counter_ns
+	n = 0
+	while not stop.is_set():
+		start = clock()
+		operation()
+		histogram.record(clock() - start)
+		n += 1
+	counts[index] = n
+# }}}
+
+def measure(threads, states, scenario, api, duration): # {{{
+	'Run one configuration; return operations per second and the merged histogram.'
+	codes = [lua.Lua() for s in range(states)]
+	stop = threading.Event()
+	histograms = [Histogram() for t in range(threads)]
+	counts = [0] * threads
+	workers = [threading.Thread(target = worker, args = (codes[t % states], scenario, api, stop, histograms[t], counts, t)) for t in range(threads)]
+	start = time.perf_counter()
+	for w in workers:
+		w.start()
+	time.sleep(duration)
+	stop.set()
+	for w in workers:
+		w.join()
+	elapsed = time.perf_counter() - start
+	total = Histogram()
+	for h in histograms:
+		total.merge(h)
+	return sum(counts) / elapsed, total
+# }}}
+
+def main(): # {{{
+	parser = argparse.ArgumentParser(description = 'Multi-core scaling and tail latency benchmark')
+	parser.add_argument('--threads', default = '1,2,4,8', help = 'comma separated thread counts')
+	parser.add_argument('--states', type = int, default = None, help = 'number of Lua instances (default: one per thread)')
+	parser.add_argument('--duration', type = float, default = 2, help = 'seconds per configuration')
+	parser.add_argument('--scenarios', default = ','.join(scenarios), help = 'comma separated scenarios')
+	parser.add_argument('--api', choices = ('call', 'run'), default = 'call', help = 'how Lua code is invoked')
+	args = parser.parse_args()
+
+	for scenario in args.scenarios.split(','):
+		print('scenario %s (%s)' % (scenario, args.api))
+		print('%7s %6s %12s %10s %10s %10s %10s' % ('threads', 'states', 'ops/s', 'scaling', 'p50 us', 'p99 us', 'p99.9 us'))
+		# The single thread run is the baseline for the scaling efficiency, so it always runs first.
+		counts = [int(t) for t in args.threads.split(',')]
+		single = None
+		for threads in [1] + [t for t in counts if t != 1]:
+			states = args.states or threads
+			rate, histogram = measure(threads, states, scenario, args.api, args.duration)
+			if single is None:
+				single = rate
+			print('%7d %6d %12.0f %9.0f%% %10.1f %10.1f %10.1f' % (threads, states, rate, 100 * rate / (threads * single),
+				histogram.percentile(50) / 1e3, histogram.percentile(99) / 1e3, histogram.percentile(99.9) / 1e3))
+		print()
+# }}}
+
+if __name__ == '__main__':
+	main()
+
+# vim: set foldmethod=marker :
@@ -0,0 +1,270 @@
+// bench.cc - Native microbenchmarks for the conversion and dispatch layers of module.cc
+/* Copyright 2023 Bas Wijnen <wijnen@debian.org> {{{
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ * }}} */
+
+/* Documentation {{{
+
+This program embeds Python, imports the lua module from the same translation
+unit, and calls Lua::push, Lua::to_python, the metamethod callbacks and the Table
+operators directly in timing loops, so the interpreter overhead of a Python
+level benchmark does not hide small changes. For every operation it reports the
+time per operation (the median and the minimum over a number of repeats) and
+the number of Python and Lua memory allocations per operation. Tables and
+functions are converted both with and without the free lists for their Python
+objects.
+
+Build it with "make bench" in this directory.
+
+Usage: ./bench [loops [repeats [name-prefix]]]
+}}} */
+
+// Includes. {{{
+#include "module.cc"
+#include <cmath>
+#include <cinttypes>
+// }}}
+
+class Benchmark { // {{{
+	// Counting wrappers around the Python allocators. {{{
+	static PyMemAllocatorEx original[3];
+	static size_t allocations;
+
+	static void *count_malloc(void *ctx, size_t size) { // {{{
+		++allocations;
+		PyMemAllocatorEx *allocator = static_cast <PyMemAllocatorEx *>(ctx);
+		return allocator->malloc(allocator->ctx, size);
+	} // }}}
+	static void *count_calloc(void *ctx, size_t nelem, size_t elsize) { // {{{
+		++allocations;
+		PyMemAllocatorEx *allocator = static_cast <PyMemAllocatorEx *>(ctx);
+		return allocator->calloc(allocator->ctx, nelem, elsize);
+	} // }}}
+	static void *count_realloc(void *ctx, void *ptr, size_t size) { // {{{
+		if (!ptr)
+			++allocations;
+		PyMemAllocatorEx *allocator = static_cast <PyMemAllocatorEx *>(ctx);
+		return allocator->realloc(allocator->ctx, ptr, size);
+	} // }}}
+	static void count_free(void *ctx, void *ptr) { // {{{
+		PyMemAllocatorEx *allocator = static_cast <PyMemAllocatorEx *>(ctx);
+		allocator->free(allocator->ctx, ptr);
+	} // }}}
+
+	// Install the counting allocators; this must be done before Python is initialized.
+	static void count_allocations() { // {{{
+		PyMemAllocatorDomain const domains[3] = {PYMEM_DOMAIN_RAW, PYMEM_DOMAIN_MEM, PYMEM_DOMAIN_OBJ};
+		for (int i = 0; i < 3; ++i) {
+			PyMem_GetAllocator(domains[i], &original[i]);
+			PyMemAllocatorEx counting = {&original[i], count_malloc, count_calloc, count_realloc, count_free};
+			PyMem_SetAllocator(domains[i], &counting);
+		}
+	} // }}}
+	// }}}
+
+	Lua *lua;
+	long loops;
+	int repeats;
+	char const *filter;
+
+	// Time an operation. The operation gets the state and must leave the stack as it found it.
+	template <typename Operation> void run(char const *name, Operation operation) { // {{{
+		if (filter && std::strncmp(name, filter, std::strlen(filter)) != 0)
+			return;
+		std::vector <double> times;
+		size_t python_allocations = 0;
+		size_t lua_allocations = 0;
+		for (int r = 0; r < repeats; ++r) {
+			size_t python_before = allocations;
+			size_t lua_before = lua->allocator.allocation_count();
+			auto start = std::chrono::steady_clock::now();
+			for (long i = 0; i < loops; ++i)
+				operation(lua->state);
+			auto end = std::chrono::steady_clock::now();
+			python_allocations += allocations - python_before;
+			lua_allocations += lua->allocator.allocation_count() - lua_before;
+			times.push_back(std::chrono::duration <double, std::nano>(end - start).count() / loops);
+			if (PyErr_Occurred()) {
+				PyErr_Print();
+				return;
+			}
+		}
+		std::sort(times.begin(), times.end());
+		double mean = 0;
+		for (auto t: times)
+			mean += t;
+		mean /= times.size();
+		double variance = 0;
+		for (auto t: times)
+			variance += (t - mean) * (t - mean);
+		double stddev = times.size() > 1 ? std::sqrt(variance / (times.size() - 1)) : 0;
+		double ops = double(loops) * repeats;
+		std::printf("%-24s %9.1f %9.1f %8.1f %10.2f %10.2f\n", name, times[times.size() / 2], times.front(), stddev, python_allocations / ops, lua_allocations / ops);
+	} // }}}
+
+public:
+	Benchmark(Lua *lua, long loops, int repeats, char const *filter) : lua(lua), loops(loops), repeats(repeats), filter(filter) {}
+
+	static int main(int argc, char **argv);
+
+	void run_all(PyObject *globals);
+}; // }}}
+
+PyMemAllocatorEx Benchmark::original[3];
+size_t Benchmark::allocations = 0;
+
+void Benchmark::run_all(PyObject *globals) { // {{{
+	std::printf("%-24s %9s %9s %8s %10s %10s\n", "operation", "median ns", "min ns", "stddev", "py allocs", "lua allocs");
+
+	// Conversions from Python to Lua. {{{
+	std::pair <char const *, PyObject *> const values[] = {
+		{"push_none", Py_None},
+		{"push_bool", Py_True},
+		{"push_int", PyLong_FromLong(12345)},
+		{"push_float", PyFloat_FromDouble(1.5)},
+		{"push_str", PyUnicode_FromString("a short string")},
+		{"push_table", lua->run("return {}", "table", false)},
+		{"push_function", lua->run("return print", "function", false)},
+		{"push_object", PyDict_GetItemString(globals, "obj")},
+	};
+	for (auto value: values) {
+		run(value.first, [this, value](lua_State *state) {
+			lua->push(value.second);
+			lua_pop(state, 1);
+		});
+	}
+	// }}}
+
+	// Conversions from Lua to Python. {{{
+	std::pair <char const *, char const *> const sources[] = {
+		{"to_python_nil", "return nil"},
+		{"to_python_boolean", "return true"},
+		{"to_python_integer", "return 12345"},
+		{"to_python_float", "return 1.5"},
+		{"to_python_string", "return 'a short string'"},
+		{"to_python_table", "return {}"},
+		{"to_python_function", "return print"},
+	};
+	for (auto source: sources) {
+		luaL_loadstring(lua->state, source.second);
+		lua_call(lua->state, 0, 1);
+		run(source.first, [this](lua_State *) {
+			Py_XDECREF(lua->to_python(-1));
+		});
+		lua_pop(lua->state, 1);
+	}
+	// Tables and functions again, in a state without free lists, so every object is allocated and freed.
+	std::pair <char const *, char const *> const wrappers[] = {
+		{"to_python_table_no_freelist", "return {}"},
+		{"to_python_function_no_freelist", "return print"},
+	};
+	Lua *saved = lua;
+	lua = reinterpret_cast <Lua *>(PyDict_GetItemString(globals, "plain"));
+	for (auto source: wrappers) {
+		luaL_loadstring(lua->state, source.second);
+		lua_call(lua->state, 0, 1);
+		run(source.first, [this](lua_State *) {
+			Py_XDECREF(lua->to_python(-1));
+		});
+		lua_pop(lua->state, 1);
+	}
+	lua = saved;
+	lua->push(PyDict_GetItemString(globals, "obj"));
+	run("to_python_userdata", [this](lua_State *) {
+		Py_XDECREF(lua->to_python(-1));
+	});
+	// }}}
+
+	// Callbacks into Python through the metatable of a Python object (still on the stack). {{{
+	run("metamethod_add", [](lua_State *state) {
+		lua_pushvalue(state, -1);
+		lua_pushinteger(state, 1);
+		lua_arith(state, LUA_OPADD);
+		lua_pop(state, 1);
+	});
+	run("metamethod_index", [](lua_State *state) {
+		lua_getfield(state, -1, "key");
+		lua_pop(state, 1);
+	});
+	run("metamethod_call", [](lua_State *state) {
+		lua_pushvalue(state, -1);
+		lua_pushinteger(state, 1);
+		lua_call(state, 1, 1);
+		lua_pop(state, 1);
+	});
+	lua_pop(lua->state, 1);
+	// }}}
+
+	// Operators on a Table from Python, through the type slots. {{{
+	PyObject *table = lua->run("return setmetatable({1, 2, 3}, {__add = function(a, b) return b end})", "operand", false);
+	PyObject *one = PyLong_FromLong(1);
+	run("table_len", [table](lua_State *) {
+		PyObject_Size(table);
+	});
+	run("table_eq", [table](lua_State *) {
+		Py_XDECREF(PyObject_RichCompare(table, table, Py_EQ));
+	});
+	run("table_add", [table, one](lua_State *) {
+		Py_XDECREF(PyNumber_Add(table, one));
+	});
+	Py_DECREF(one);
+	Py_DECREF(table);
+	// }}}
+
+	for (auto value: values)
+		if (value.second != Py_None && value.second != Py_True && value.second != PyDict_GetItemString(globals, "obj"))
+			Py_DECREF(value.second);
+} // }}}
+
+int Benchmark::main(int argc, char **argv) { // {{{
+	long loops = argc > 1 ? std::atol(argv[1]) : 1000000;
+	int repeats = argc > 2 ? std::atoi(argv[2]) : 7;
+	char const *filter = argc > 3 ? argv[3] : nullptr;
+
+	count_allocations();
+	PyImport_AppendInittab("lua", PyInit_lua);
+	Py_Initialize();
+
+	// A Python object with methods for the metamethod benchmarks.
+	PyObject *globals = PyDict_New();
+	PyDict_SetItemString(globals, "__builtins__", PyEval_GetBuiltins());
+	PyObject *result = PyRun_String(
+			"import lua\n"
+			"class Obj:\n"
+			"	def __add__(self, other): return other\n"
+			"	def __getitem__(self, key): return key\n"
+			"	def __call__(self, arg): return arg\n"
+			"obj = Obj()\n"
+			"code = lua.Lua()\n"
+			"plain = lua.Lua(freelist_size = 0)\n",
+			Py_file_input, globals, globals);
+	if (!result) {
+		PyErr_Print();
+		return 1;
+	}
+	Py_DECREF(result);
+
+	Lua *lua = reinterpret_cast <Lua *>(PyDict_GetItemString(globals, "code"));
+	Benchmark(lua, loops, repeats, filter).run_all(globals);
+
+	Py_DECREF(globals);
+	return Py_FinalizeEx() < 0 ? 1 : 0;
+} // }}}
+
+int main(int argc, char **argv) {
+	return Benchmark::main(argc, argv);
+}
+
+// vim: set foldmethod=marker :
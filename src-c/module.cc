@@ -85,29 +85,73 @@ lua.module(name, object)
 // Includes. {{{
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <structmember.h>
 #include <lua.hpp>
 #include <lauxlib.h>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <thread>
 #include <map>
 #include <utility>
 #include <string>
+#include <cstddef>
+#include <mutex>
+#include <list>
+#include <new>
+#include <unordered_map>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <numeric>
+#include <atomic>
+#include <functional>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 // }}}
 
-extern PyTypeObject LuaType, TableType, FunctionType;
-
 class Lua;
 class Function;
 class Table;
+class LuaPool;
+
+// Module state. {{{
+// Every interpreter that imports the module gets its own types, so nothing is shared between subinterpreters.
+struct ModuleState {
+	PyTypeObject *LuaType;
+	PyTypeObject *FunctionType;
+	PyTypeObject *TableType;
+	PyTypeObject *LuaPoolType;
+	PyObject *LimitExceeded;	// Exception for running out of instructions or time.
+	PyObject *Cancelled;	// Exception for calls that were stopped by Lua.cancel().
+};
+
+extern PyModuleDef Module;
+
+// Get the state of the module that created a type.
+static ModuleState *module_state(PyTypeObject *type) { // {{{
+	PyObject *module = PyType_GetModuleByDef(type, &Module);	// Borrowed reference.
+	return module ? reinterpret_cast <ModuleState *>(PyModule_GetState(module)) : nullptr;
+} // }}}
+// }}}
 
 class Lua { // {{{
 	friend class Function;
 	friend class Table;
+	friend class LuaPool;
+	friend class Benchmark;
 
 public:
 	PyObject_HEAD
 
 	// Constructor.
-	Lua(bool debug = false, bool loadlib = false, bool searchers = false, bool doloadfile = false, bool io = false, bool os = false, bool python_module = true);
+	Lua(ModuleState *types, bool debug = false, bool loadlib = false, bool searchers = false, bool doloadfile = false, bool io = false, bool os = false, bool python_module = true, Py_ssize_t chunk_cache_size = 64, char const *bytecode_cache = nullptr, bool slab_allocator = false, Py_ssize_t memory_limit = 0, int hook_interval = 1000, bool count_instructions = false, Py_ssize_t freelist_size = 256);
 
 	// __new__ function for creating the Python object.
 	static PyObject *create(PyTypeObject *type, PyObject *args, PyObject *kwds);
@@ -117,13 +161,107 @@ public:
 
 	static PyMethodDef methods[];
 
+	// Types of the module that created this object; they are kept alive by the reference from the object to its type.
+	ModuleState *types;
+
 private:
 	// Context for Lua environment.
 	lua_State *state;
 
-	// Names for generating lua functions that perform operator calls.
-	// First item is lua operator code, second item is python metamethod name.
-	static std::map <char const *, char const *> const opnames;
+	// Memory allocator for the state. {{{
+	// Small blocks can come from slabs that are split into blocks of a fixed size class, with a free list per class.
+	// A state is only used by one thread at a time (see Lock), so the allocator needs no locking and states do not
+	// contend with each other the way they do in malloc.
+	class Allocator { // {{{
+		// Size classes are multiples of granularity, up to max_small bytes; that covers strings, tables,
+		// closures and upvalues. Larger blocks (arrays, hash parts, long strings) use the system allocator.
+		static constexpr size_t granularity = 16;
+		static constexpr size_t max_small = 256;
+		static constexpr size_t num_classes = max_small / granularity;
+		static constexpr size_t slab_size = 64 * 1024;
+
+		struct FreeBlock {
+			FreeBlock *next;
+		};
+
+		bool use_slabs;
+		FreeBlock *free_lists[num_classes];
+
+		// Accounting. Only the sizes that Lua requests are counted, not the slack in slabs or size classes.
+		size_t current;
+		size_t peak;
+		size_t allocations;
+		size_t frees;
+		std::vector <void *> slabs;
+		char *unused;	// Part of the newest slab that has not been handed out yet.
+		size_t unused_size;
+
+		static size_t size_class(size_t size) { return (size - 1) / granularity; }
+		void *allocate(size_t size);
+		void release(void *block, size_t size);
+	public:
+		Allocator(bool use_slabs) : use_slabs(use_slabs), free_lists{}, current(0), peak(0), allocations(0), frees(0), unused(nullptr), unused_size(0), limit(0), enforce_limit(false) {}
+		~Allocator() {
+			for (auto slab: slabs)
+				std::free(slab);
+		}
+		Allocator(Allocator const &) = delete;
+		Allocator &operator=(Allocator const &) = delete;
+
+		// Maximum for current, or 0 for no limit. Growing allocations fail when it would be exceeded; Lua then
+		// runs an emergency collection and tries again, before raising a memory error.
+		size_t limit;
+		// The limit is only enforced while Lua code runs in a protected call; elsewhere an error would be fatal.
+		bool enforce_limit;
+
+		// lua_Alloc callback; ud is the Allocator.
+		static void *alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+		// Get the accounting numbers as a dict.
+		PyObject *stats() const;
+
+		// Number of allocations so far.
+		size_t allocation_count() const { return allocations; }
+	}; // }}}
+	Allocator allocator;
+
+	// Replacement for the panic function that luaL_newstate() installs.
+	static int panic(lua_State *state);
+	// }}}
+
+	// Memory of destroyed Table and Function objects, for reuse. {{{
+	// Every table or function that is returned to Python gets a new object, which is usually dropped soon after.
+	// Instead of freeing its memory, dealloc puts it on the free list of its state, up to capacity objects, and
+	// create takes it from there. All objects of a list have the same type, so they have the same size. Like the
+	// rest of the state, a free list is protected by Lock.
+	class Freelist { // {{{
+		std::vector <PyObject *> objects;
+		size_t capacity;
+		Py_ssize_t reused;	// Objects that were taken from the list.
+		Py_ssize_t allocated;	// Objects that were allocated because the list was empty.
+		Py_ssize_t kept;	// Objects that were put on the list.
+		Py_ssize_t released;	// Objects that were freed because the list was full.
+	public:
+		Freelist(size_t capacity) : capacity(capacity), reused(0), allocated(0), kept(0), released(0) {}
+		~Freelist() {
+			for (auto obj: objects)
+				PyObject_Free(obj);
+		}
+		Freelist(Freelist const &) = delete;
+		Freelist &operator=(Freelist const &) = delete;
+
+		// Get a new object of the given type; the caller must initialize everything after the object header.
+		PyObject *alloc(PyTypeObject *type);
+
+		// Dispose of the memory of an object from alloc(), instead of calling tp_free. This does not release the type.
+		void free(PyObject *obj);
+
+		// Get the statistics as a dict.
+		PyObject *stats() const;
+	}; // }}}
+	Freelist table_freelist;
+	Freelist function_freelist;
+	// }}}
 
 	// Names for calling python metamethods from lua metatable.
 	// First item is lua metatable name key, seconde item is python metamethod name.
@@ -134,23 +272,375 @@ private:
 	PyObject *package_loaded;
 	PyObject *_G;
 
-	// Stored Lua functions of all operators, to be used from Python calls on Lua-owned objects.
-	std::map <char const *, PyObject *> ops;
+	// Cache of compiled chunks for run(), with least recently used chunk at the back. {{{
+	// Chunks are identified by their name and source. The index refers to the strings that are stored in the list.
+	// Keeping the source means copying it, so larger code (such as a big buffer or mapped file) is not cached.
+	static constexpr size_t max_cached_source = 64 * 1024;
+	struct Chunk {
+		std::string name;
+		std::string source;
+		int ref;	// Registry index of the compiled chunk.
+	};
+	struct ChunkKey {
+		std::string_view name;
+		std::string_view source;
+		bool operator==(ChunkKey const &other) const = default;
+	};
+	struct ChunkKeyHash {
+		size_t operator()(ChunkKey const &key) const { return std::hash <std::string_view>()(key.source) * 31 + std::hash <std::string_view>()(key.name); }
+	};
+	typedef std::list <Chunk> ChunkList;
+	ChunkList chunks;
+	std::unordered_map <ChunkKey, ChunkList::iterator, ChunkKeyHash> chunk_index;
+	Py_ssize_t chunk_cache_size;
+	Py_ssize_t chunk_hits;
+	Py_ssize_t chunk_misses;
+	Py_ssize_t chunk_evictions;
+	// }}}
+
+	// Directory for compiled files from run_file(), or empty if disabled.
+	std::string bytecode_cache;
+
+	// Interned Python method names, used as upvalues of the metamethods. Keys are the names from lua2python.
+	std::map <char const *, PyObject *> method_names;
+
+	// Operators that are dispatched directly to a Python type slot, if the type has it.
+	struct NumberSlot {
+		char const *lua_name;
+		size_t offset;	// Offset of the slot in PyNumberMethods.
+		void *fallback;	// Abstract API function to use if the slot returns NotImplemented.
+	};
+	static NumberSlot const binary_slots[];
+	static NumberSlot const unary_slots[];
+
+	// Metatables for userdata objects, per Python type. Values are registry indices.
+	std::map <PyTypeObject *, int> metatables;
+
+	// Number of arguments for which metamethod does not need to allocate an argument array.
+	static constexpr int max_stack_args = 8;
+
+	// Execution limits and instruction counting. {{{
+	// A count hook is only installed while a call with limits (or with count_instructions) runs. It is called every
+	// hook_interval instructions, so the counts are multiples of that and the cost per instruction is negligible.
+	int hook_interval;
+	bool count_instructions;
+	int call_depth;	// Number of nested calls with a Limits object; the outermost call sets the limits.
+	bool counting;	// The outermost call counts instructions.
+	long long instructions;	// Instructions run by the current outermost call.
+	long long max_instructions;	// 0 for no limit.
+	std::chrono::steady_clock::time_point deadline;
+	// Count for the last finished outermost call of every thread, or -1 if it was not counted.
+	std::unordered_map <std::thread::id, long long> last_instructions;
+	char const *limit_hit;	// Error message once a limit has been exceeded, otherwise nullptr.
+
+	// Cancellation. {{{
+	// cancel() may be called from any thread while another thread runs Lua code. It only sets the flag and
+	// arms the hook for the next instruction; nothing is checked while no cancel has been requested.
+	static char const cancelled[];	// Value of limit_hit after a cancel.
+	std::atomic <int> running;	// Number of nested calls in progress.
+	std::atomic <bool> cancel_requested;
+	// }}}
+
+	// Coroutines. {{{
+	// Hooks are per thread, so coroutine.resume() and coroutine.wrap() are replaced by versions that give the
+	// coroutine the hook of the thread that resumes it and record it as the running thread for cancel().
+	std::mutex current_mutex;	// Protects current and changes of running against cancel().
+	lua_State *current;	// Thread (the main state or a coroutine) that is running Lua code.
+
+	// Resume co with nargs arguments from the stack of caller, like auxresume() in lcorolib.c.
+	// Returns the number of results that were moved to caller, or -1 with the error message on its stack.
+	int resume_thread(lua_State *caller, lua_State *co, int nargs);
+	static int coroutine_resume(lua_State *state);
+	static int coroutine_wrap(lua_State *state);
+	static int wrapped_coroutine(lua_State *state);
+	// }}}
+
+	// Sampling profiler. {{{
+	// The profiler shares the count hook with the limits; the hook count is the gcd of both intervals.
+	int profile_interval;	// Instructions between samples, or 0 when the profiler is not running.
+	int hook_count;	// Count that the hook is currently installed with.
+	long long since_sample;
+	std::unordered_map <std::string, long long> profile;	// Number of samples per collapsed stack.
+
+	// For every call into Lua while profiling: the Python frame that made the call, and the Python frames
+	// since the previous call into Lua, as collapsed stack text. They are inserted at the callback boundaries.
+	std::vector <std::pair <PyFrameObject *, std::string> > python_frames;
+
+	// Record a sample of the stack. This runs from the hook, without the GIL.
+	void sample(lua_State *state);
+
+	// Get the Python frames since the previous call into Lua. Called with the GIL.
+	std::pair <PyFrameObject *, std::string> python_stack();
+	// }}}
+
+	// Boundary statistics. {{{
+	// Counters for crossings between Lua and Python. They are only compiled in when PYTHON_LUA_STATS is defined
+	// (see setup.py); otherwise all methods are empty and calls to them are optimized away.
+	class Stats { // {{{
+	public:
+		// Kinds of Python values that are pushed.
+		enum PushKind { PUSH_NONE, PUSH_BOOL, PUSH_INT, PUSH_STR, PUSH_FLOAT, PUSH_TABLE, PUSH_FUNCTION, PUSH_OBJECT, NUM_PUSH_KINDS };
+#ifdef PYTHON_LUA_STATS
+	private:
+		typedef std::chrono::steady_clock Clock;
+		long long pushes[NUM_PUSH_KINDS];
+		long long conversions[LUA_NUMTYPES];	// to_python() calls per Lua type.
+		std::unordered_map <std::string, long long> callbacks;	// Callbacks into Python per metamethod.
+		long long finalizers;
+		long long refs;
+		long long unrefs;
+		Clock::duration lua_time;
+		Clock::duration python_time;
+		Clock::time_point last_switch;
+	public:
+		Stats() { reset(); }
+		void reset() { // {{{
+			std::fill(std::begin(pushes), std::end(pushes), 0);
+			std::fill(std::begin(conversions), std::end(conversions), 0);
+			callbacks.clear();
+			finalizers = 0;
+			refs = 0;
+			unrefs = 0;
+			lua_time = Clock::duration::zero();
+			python_time = Clock::duration::zero();
+		} // }}}
+		void push(PushKind kind) { pushes[kind] += 1; }
+		void to_python(int type) { if (type >= 0 && type < LUA_NUMTYPES) conversions[type] += 1; }
+		void callback(lua_State *state) { // {{{
+			// Lua knows which metamethod it called; calls through __call look like normal calls.
+			lua_Debug ar;
+			std::string name = "__call";
+			if (lua_getstack(state, 0, &ar) && lua_getinfo(state, "n", &ar) && ar.name && std::strcmp(ar.namewhat, "metamethod") == 0)
+				name = std::strncmp(ar.name, "__", 2) == 0 ? ar.name : std::string("__") + ar.name;
+			callbacks[name] += 1;
+		} // }}}
+		void finalizer() { finalizers += 1; }
+		void ref() { refs += 1; }
+		void unref() { unrefs += 1; }
+		// Time accounting. Time between the start and end of the outermost call into Lua is split between Lua and Python.
+		void enter_lua(bool nested) { Clock::time_point now = Clock::now(); if (nested) python_time += now - last_switch; last_switch = now; }
+		void leave_lua() { Clock::time_point now = Clock::now(); lua_time += now - last_switch; last_switch = now; }
+		void enter_python() { leave_lua(); }
+		void leave_python() { enter_lua(true); }
+#else
+		void reset() {}
+		void push(PushKind) {}
+		void to_python(int) {}
+		void callback(lua_State *) {}
+		void finalizer() {}
+		void ref() {}
+		void unref() {}
+		void enter_lua(bool) {}
+		void leave_lua() {}
+		void enter_python() {}
+		void leave_python() {}
+#endif
+		// Get the statistics as a dict; without PYTHON_LUA_STATS, this raises an exception.
+		PyObject *get() const;
+	}; // }}}
+	Stats stats;
+
+	// Create a reference in the registry to the value on top of the stack and pop it.
+	int ref() { // {{{
+		stats.ref();
+		return luaL_ref(state, LUA_REGISTRYINDEX);
+	} // }}}
+
+	// Release a reference that was created with ref().
+	void unref(int id) { // {{{
+		stats.unref();
+		luaL_unref(state, LUA_REGISTRYINDEX, id);
+	} // }}}
+	// }}}
+
+	// Install or remove the hook, depending on what needs it.
+	void update_hook();
+
+	// Count hook.
+	static void hook(lua_State *state, lua_Debug *ar);
+
+	// Apply limits to the calls into Lua that are made while this object exists. {{{
+	class Limits {
+		Lua *lua;
+		bool outer;
+	public:
+		Limits(Lua *lua, Py_ssize_t max_instructions, double timeout);
+		~Limits();
+	}; // }}}
+	// }}}
+
+	// Locking. {{{
+	// Lua code runs without holding the GIL. Every access to the state is serialized by the mutex,
+	// which is recursive because Python callbacks from Lua may call into the same state again.
+	std::recursive_mutex mutex;
+
+	// Thread state of the thread that is running Lua code without the GIL, or nullptr when the GIL is held.
+	PyThreadState *released;
+
+	// Lock the state for use from Python. The GIL is released while waiting, so a thread that runs Lua code can call back into Python.
+	// On free-threaded builds this lock is what keeps threads from using the same lua_State at the same time; waiting
+	// detaches the thread state, so a thread that waits does not block garbage collection.
+	class Lock { // {{{
+		Lua *lua;
+	public:
+		Lock(Lua *lua) : lua(lua) {
+			if (lua->mutex.try_lock())
+				return;
+			Py_BEGIN_ALLOW_THREADS
+			lua->mutex.lock();
+			Py_END_ALLOW_THREADS
+		}
+		~Lock() { lua->mutex.unlock(); }
+	}; // }}}
+
+	// Call function on the stack (like lua_pcall) without holding the GIL.
+	// On error, the function and arguments are removed, a Python exception is set and false is returned.
+	bool call(int nargs, int nresults) { // {{{
+		int pos = lua_gettop(state) - nargs - 1;
+		bool outer;
+		lua_State *previous;
+		{
+			std::lock_guard <std::mutex> guard(current_mutex);
+			// A cancel() from before the outermost call started is not for this call.
+			outer = running == 0;
+			if (outer)
+				cancel_requested = false;
+			running += 1;
+			previous = current;
+			current = state;
+		}
+		bool profiling = profile_interval > 0;
+		if (profiling)
+			python_frames.push_back(python_stack());
+		stats.enter_lua(!outer);
+		released = PyEval_SaveThread();
+		bool limited = allocator.enforce_limit;
+		allocator.enforce_limit = true;
+		int status = lua_pcall(state, nargs, nresults, 0);
+		allocator.enforce_limit = limited;
+		if (!limit_hit && cancel_requested)
+			limit_hit = cancelled;
+		if (status == LUA_OK && limit_hit) {
+			// The error was caught on the way, for example by a resume() in a tail call; the call still fails.
+			lua_settop(state, pos);
+			lua_pushstring(state, limit_hit);
+			status = LUA_ERRRUN;
+		}
+		PyThreadState *thread = released;
+		released = nullptr;
+		PyEval_RestoreThread(thread);
+		stats.leave_lua();
+		if (profiling && !python_frames.empty())
+			python_frames.pop_back();
+		if (status != LUA_OK) {
+			error_to_python(status);
+			lua_settop(state, pos);
+		}
+		{
+			std::lock_guard <std::mutex> guard(current_mutex);
+			running -= 1;
+			current = previous;
+			// A callback from a coroutine called back into Lua; the cancel must also stop the coroutine.
+			if (!outer && cancel_requested)
+				lua_sethook(current, hook, LUA_MASKCOUNT, 1);
+		}
+		if (outer && cancel_requested.exchange(false)) {
+			// Disarm the hook that cancel() installed; limits that are still active keep theirs.
+			if (call_depth == 0)
+				limit_hit = nullptr;
+			update_hook();
+		}
+		return status == LUA_OK;
+	} // }}}
+
+	// Get the GIL in a callback from Lua. The return value must be passed to leave_python() when done.
+	// If the GIL is already held (because Lua was not entered through call()), this does nothing.
+	// The memory limit is not enforced while Python code runs, because a Lua error must not unwind through it.
+	// The argument is the state (or coroutine) that made the callback.
+	PyThreadState *enter_python(lua_State *caller) { // {{{
+		stats.callback(caller);
+		PyThreadState *thread = released;
+		if (thread) {
+			stats.enter_python();
+			released = nullptr;
+			allocator.enforce_limit = false;
+			PyEval_RestoreThread(thread);
+		}
+		return thread;
+	} // }}}
+
+	// Release the GIL again after enter_python().
+	void leave_python(PyThreadState *thread) { // {{{
+		if (thread) {
+			released = PyEval_SaveThread();
+			allocator.enforce_limit = true;
+			stats.leave_python();
+		}
+	} // }}}
+	// }}}
+
+	// Get back pointer to self from a Lua state (or thread) owned by this object.
+	static Lua *owner(lua_State *state) { return *reinterpret_cast <Lua **>(lua_getextraspace(state)); }
 
 	// Lua callback for all userdata metamethods. (Method selection is done via operator name stored in upvalue.)
 	static int metamethod(lua_State *state);
 
+	// Lua callbacks that call a Python type slot directly. (The slot is stored in upvalue 1, the fallback, if any, in upvalue 2.)
+	static int unary_slot(lua_State *state);
+	static int binary_slot(lua_State *state);
+	static int power_slot(lua_State *state);
+	static int length_slot(lua_State *state);
+	static int compare_slot(lua_State *state);
+	static int setitem_slot(lua_State *state);
+
+	// Convert the first n values on the stack to Python, as new references in args.
+	// If a value cannot be converted, no references are kept, a Python exception is set and false is returned.
+	bool slot_arguments(int n, PyObject **args);
+
 	// Lua callback for userdata garbage collection.
 	static int gc(lua_State *state);
 
+	// Convert the Lua error object on top of the stack into a Python exception and pop it.
+	// Memory errors become MemoryError, everything else ValueError.
+	void error_to_python(int status);
+
+	// Raise the pending Python exception as a Lua error. This gives up the GIL if thread is set, see leave_python().
+	static int python_error(lua_State *state, PyThreadState *thread);
+
+	// Push metatable for userdata objects of the given Python type, creating it if needed.
+	void push_metatable(PyTypeObject *type);
+
 	// Set variable in Lua.
 	void set(std::string const &name, PyObject *value);
 
+	// Convert return values above pos on the stack into a Python value and pop them.
+	PyObject *return_values(int pos, bool keep_single);
+
 	// Run code after having loaded the buffer (internal use only).
 	PyObject *run_code(int pos, bool keep_single);
 
+	// Push compiled chunk for a string on the stack, from the cache if possible. Returns Lua status code.
+	int load_chunk(std::string_view cmd, std::string const &description);
+
+	// Push compiled chunk for a file on the stack, from the bytecode cache if possible. Returns Lua status code.
+	int load_file(std::string const &filename);
+
+	// Push compiled chunk for a source file on the stack; large files are mapped instead of read. Returns Lua status code.
+	int load_source(std::string const &filename);
+	static constexpr off_t mmap_threshold = 64 * 1024;
+
+	// lua_Writer that appends to a std::string.
+	static int dump_writer(lua_State *state, void const *data, size_t size, void *target);
+
 	// Run string in Lua.
-	PyObject *run(std::string const &cmd, std::string const &description, bool keep_single);
+	PyObject *run(std::string_view cmd, std::string const &description, bool keep_single);
+
+	// Run code that is read from a Python file-like object or iterator in Lua.
+	PyObject *run_stream(PyObject *source, std::string const &description, bool keep_single);
+
+	// lua_Reader for run_stream.
+	struct StreamReader;
+	static char const *stream_reader(lua_State *state, void *data, size_t *size);
 
 	// Run file in Lua.
 	PyObject *run_file(std::string const &filename, std::string const &description, bool keep_single);
@@ -172,6 +662,22 @@ private:
 	static PyObject *run_method(Lua *self, PyObject *args, PyObject *keywords);
 	static PyObject *run_file_method(Lua *self, PyObject *args, PyObject *keywords);
 	static PyObject *module_method(Lua *self, PyObject *args);
+	static PyObject *chunk_cache_stats_method(Lua *self, PyObject *args);
+	static PyObject *memory_stats_method(Lua *self, PyObject *args);
+	static PyObject *freelist_stats_method(Lua *self, PyObject *args);
+	static PyObject *last_instructions_method(Lua *self, PyObject *args);
+	static PyObject *cancel_method(Lua *self, PyObject *args);
+	static PyObject *start_profiler_method(Lua *self, PyObject *args, PyObject *keywords);
+	static PyObject *stop_profiler_method(Lua *self, PyObject *args);
+	static PyObject *stats_method(Lua *self, PyObject *args);
+	static PyObject *reset_stats_method(Lua *self, PyObject *args);
+	// }}}
+
+	// Functions of the "python" module in Lua. Their self is the Table type. {{{
+	static PyMethodDef python_functions[];
+	static PyObject *python_list(PyObject *table_type, PyObject *arg);
+	static PyObject *python_dict(PyObject *table_type, PyObject *arg);
+	static PyObject *python_bytes(PyObject *table_type, PyObject *arg);
 	// }}}
 }; // }}}
 
@@ -179,6 +685,9 @@ class Function { // {{{
 public:
 	PyObject_HEAD
 
+	// Vectorcall entry point; must directly follow the header, see Function::members.
+	vectorcallfunc vectorcall;
+
 	// Construct new function from value at top of stack.
 	Function(Lua *context);
 
@@ -189,6 +698,7 @@ public:
 	static PyObject *create(Lua *context);
 
 	static PyMethodDef methods[];
+	static PyMemberDef members[];
 
 private:
 	// Context in which this object is defined.
@@ -197,8 +707,15 @@ private:
 	// Registry index holding the Lua function.
 	lua_Integer id;
 
+	// Call the function (tp_call through PEP 590 vectorcall).
+	static PyObject *call(Function *self, PyObject *const *args, size_t nargsf, PyObject *kwnames);
+
+	// Call the function for every item (or unpacked item, if star is set) of iterable; store results in out, or a new list.
+	PyObject *map(PyObject *iterable, PyObject *out, bool star);
+
 	// Python-accessible methods.
-	static PyObject *call_method(Function *self, PyObject *args, PyObject *keywords);
+	static PyObject *map_method(Function *self, PyObject *args, PyObject *keywords);
+	static PyObject *starmap_method(Function *self, PyObject *args, PyObject *keywords);
 
 	friend class Lua;
 }; // }}}
@@ -220,108 +737,295 @@ public:
 
 	static PyMethodDef methods[];
 
+	// Operators that can be applied to tables from Python. The arithmetic operators come first, with their LUA_OP* code.
+	enum Operator {
+		OP_ADD = LUA_OPADD, OP_SUB = LUA_OPSUB, OP_MUL = LUA_OPMUL, OP_MOD = LUA_OPMOD, OP_POW = LUA_OPPOW,
+		OP_DIV = LUA_OPDIV, OP_IDIV = LUA_OPIDIV, OP_BAND = LUA_OPBAND, OP_BOR = LUA_OPBOR, OP_BXOR = LUA_OPBXOR,
+		OP_SHL = LUA_OPSHL, OP_SHR = LUA_OPSHR, OP_UNM = LUA_OPUNM, OP_BNOT = LUA_OPBNOT,
+		OP_EQ, OP_LT, OP_LE, OP_CONCAT, OP_LEN, NUM_OPERATORS
+	};
+
+	// Type slots. {{{
+	// Operators are implemented on the type, so a Table object holds nothing but its state and its registry index.
+	template <Operator op> static PyObject *binary(PyObject *a, PyObject *b) { return operate(op, a, b); }
+	template <Operator op> static PyObject *unary(PyObject *self) { return operate(op, self, nullptr); }
+	static PyObject *power(PyObject *a, PyObject *b, PyObject *mod);
+	static PyObject *inplace_add(Table *self, PyObject *other);
+	static PyObject *richcompare(Table *self, PyObject *other, int op);
+	static Py_hash_t hash(Table *self);
+	static Py_ssize_t length(Table *self);
+	static PyObject *subscript(Table *self, PyObject *key);
+	static int ass_subscript(Table *self, PyObject *key, PyObject *value);
+	static int contains(Table *self, PyObject *key);
+	static PyObject *iter(Table *self);
+	// }}}
+
 private:
 	// Context in which this object is defined.
 	Lua *lua;
 
+	// Check if an object is a Table. Each interpreter has its own Table type, but they all share the same dealloc.
+	static bool check(PyObject *obj) { return Py_TYPE(obj)->tp_dealloc == reinterpret_cast <destructor>(dealloc); }
+
+	// Operators. {{{
+	// Each operator is a Lua C function that applies it to its arguments with the Lua API, so it runs in a protected
+	// call and uses metamethods like the operator in Lua code would.
+	static lua_CFunction const operators[NUM_OPERATORS];
+	template <int op> static int arith(lua_State *state) { lua_arith(state, op); return 1; }
+	template <int op> static int compare(lua_State *state) { lua_pushboolean(state, lua_compare(state, 1, 2, op)); return 1; }
+	static int concat(lua_State *state) { lua_concat(state, 2); return 1; }
+	static int len(lua_State *state) { lua_len(state, 1); return 1; }
+
+	// Apply an operator to a and b (or only a, if b is nullptr). At least one of them is a Table.
+	static PyObject *operate(Operator op, PyObject *a, PyObject *b);
+	// }}}
+
+	// Call a Lua function on the table and up to two arguments, using Lua::call() so errors in metamethods are caught.
+	// The result is left on the stack; on error, false is returned and the stack is unchanged.
+	bool call_lua(lua_CFunction function, PyObject *arg1, PyObject *arg2, int nresults);
+	static int gettable(lua_State *state) { lua_gettable(state, 1); return 1; }
+	static int settable(lua_State *state) { lua_settable(state, 1); return 0; }
+
 	// Python-accessible methods.
-	static PyObject *len_method(Table *self, PyObject *args);
-	static PyObject *iadd_method(Table *self, PyObject *args);
-	static PyObject *getitem_method(Table *self, PyObject *args);
-	static PyObject *setitem_method(Table *self, PyObject *args);
-	static PyObject *delitem_method(Table *self, PyObject *args);
-	static PyObject *contains_method(Table *self, PyObject *args);
-	static PyObject *iter_method(Table *self, PyObject *args);
-	static PyObject *ne_method(Table *self, PyObject *args);
-	static PyObject *gt_method(Table *self, PyObject *args);
-	static PyObject *ge_method(Table *self, PyObject *args);
 	static PyObject *dict_method(Table *self, PyObject *args);
-	static PyObject *list_method(Table *self, PyObject *args);
+	static PyObject *list_method(Table *self, PyObject *args, PyObject *keywords);
 	static PyObject *pop_method(Table *self, PyObject *args);
 
 	friend class Lua;
 }; // }}}
 
+class LuaPool { // {{{
+public:
+	PyObject_HEAD
+
+	// __new__ function for creating the Python object.
+	static PyObject *create(PyTypeObject *type, PyObject *args, PyObject *kwds);
+
+	// Cleanup.
+	static void dealloc(LuaPool *self);
+
+	static PyMethodDef methods[];
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	// Calls waiting to be run by a worker. {{{
+	struct Batch {
+		PyObject *results;	// List of results, filled in by the workers.
+		Py_ssize_t remaining;	// Number of jobs that have not finished; protected by mutex.
+		PyObject *error;	// First exception that was raised, if any.
+	};
+	struct Job {
+		PyObject *name;	// Name of the global Lua function to call.
+		PyObject *args;	// Tuple of arguments.
+		PyObject *future;	// concurrent.futures.Future for the result, or nullptr if this job is part of a batch.
+		Batch *batch;
+		Py_ssize_t index;	// Position of the result in the batch.
+		Clock::time_point queued;
+	};
+	std::deque <Job> jobs;
+	// }}}
+
+	// States and statistics. Everything except states is protected by mutex. {{{
+	std::vector <Lua *> states;	// Owned references.
+	std::vector <bool> leased;
+	std::vector <Py_ssize_t> calls;
+	std::vector <Clock::duration> busy;
+	std::unordered_map <std::thread::id, size_t> affinity;	// Last state that was leased by each thread.
+	Clock::time_point started;
+	Py_ssize_t jobs_done;
+	Clock::duration queue_wait;
+	Clock::duration max_queue_wait;
+	// }}}
+
+	// Synchronization. {{{
+	// The mutex is never held while (waiting for) holding the GIL, so it can be taken with or without the GIL.
+	std::mutex mutex;
+	std::condition_variable job_available;
+	std::condition_variable state_available;
+	std::condition_variable batch_done;
+	std::vector <std::thread> workers;
+	bool stopping;
+
+	// Set by dealloc when the last reference was dropped by a worker, for example from a Future callback. That worker
+	// still runs code of the pool when dealloc returns, so it destroys the pool itself when it exits. Only that
+	// worker uses the flag.
+	bool destroy_on_exit;
+
+	// Interpreter that created the pool; the workers run Python code in it.
+	PyInterpreterState *interpreter;
+	// }}}
+
+	// Lease a state, preferring the given one if it is free. Called with the GIL, which is released while waiting.
+	size_t lease(size_t preferred);
+
+	// Return a leased state to the pool.
+	void unlease(size_t index);
+
+	// Worker thread main loop; the worker prefers the state with the same index.
+	void work(size_t index);
+
+	// Run a job and deliver its result. Called with the GIL.
+	void run_job(Job &job, size_t worker);
+
+	// Add jobs to the queue. If the pool has been closed, nothing is queued and false is returned.
+	bool enqueue(std::vector <Job> &new_jobs);
+
+	// Stop the workers after they have finished all queued jobs.
+	// Returns true if it was called from a worker, which then keeps running until it returns to work().
+	bool close();
+
+	// Release the states and free the object; the rest of dealloc.
+	static void destroy(LuaPool *self);
+
+	// Python-accessible methods. {{{
+	static PyObject *submit_method(LuaPool *self, PyObject *args);
+	static PyObject *map_method(LuaPool *self, PyObject *args);
+	static PyObject *acquire_method(LuaPool *self, PyObject *args);
+	static PyObject *release_method(LuaPool *self, PyObject *args);
+	static PyObject *stats_method(LuaPool *self, PyObject *args);
+	static PyObject *close_method(LuaPool *self, PyObject *args);
+	// }}}
+}; // }}}
+
 // Module registration. {{{
-#define ObjDef(name, doc, create) \
-PyTypeObject name ## Type { \
-	/* XXX Using .ob_base is undocumented, but otherwise C++ does not allow specifying the other identifiers by name. */ \
-	.ob_base = PyVarObject_HEAD_INIT(nullptr, 0) \
-	.tp_name = "lua." #name, \
-	.tp_basicsize = sizeof(name), \
-	.tp_itemsize = 0, \
-	.tp_dealloc = reinterpret_cast <destructor>(name::dealloc), \
-	.tp_flags = Py_TPFLAGS_DEFAULT, \
-	.tp_doc = PyDoc_STR(doc), \
-	.tp_methods = name::methods, \
-	.tp_new = create, \
+#define ObjDef(cls, doc, typeflags, ...) \
+PyType_Slot cls ## Slots[] = { \
+	{Py_tp_dealloc, reinterpret_cast <void *>(cls::dealloc)}, \
+	{Py_tp_doc, const_cast <char *>(doc)}, \
+	{Py_tp_methods, cls::methods}, \
+	__VA_ARGS__ \
+	{0, nullptr} \
+}; \
+PyType_Spec cls ## Spec { \
+	.name = "lua." #cls, \
+	.basicsize = sizeof(cls), \
+	.itemsize = 0, \
+	.flags = Py_TPFLAGS_DEFAULT | typeflags, \
+	.slots = cls ## Slots, \
 }
 
-ObjDef(Lua, "Hold Lua object state", Lua::create);
-ObjDef(Function, "Access a Lua-owned function from Python", nullptr);
-ObjDef(Table, "Access a Lua-owned table from Python", nullptr);
+ObjDef(Lua, "Hold Lua object state", 0, {Py_tp_new, reinterpret_cast <void *>(Lua::create)},);
+// Function is callable; Function::vectorcall is found through Function::members.
+ObjDef(Function, "Access a Lua-owned function from Python", Py_TPFLAGS_DISALLOW_INSTANTIATION | Py_TPFLAGS_HAVE_VECTORCALL, {Py_tp_members, Function::members}, {Py_tp_call, reinterpret_cast <void *>(PyVectorcall_Call)},);
+#define TableSlot(slot, function) {Py_ ## slot, reinterpret_cast <void *>(Table::function)}
+ObjDef(Table, "Access a Lua-owned table from Python", Py_TPFLAGS_DISALLOW_INSTANTIATION,
+	TableSlot(nb_add, binary <Table::OP_ADD>),
+	TableSlot(nb_subtract, binary <Table::OP_SUB>),
+	TableSlot(nb_multiply, binary <Table::OP_MUL>),
+	TableSlot(nb_true_divide, binary <Table::OP_DIV>),
+	TableSlot(nb_remainder, binary <Table::OP_MOD>),
+	TableSlot(nb_power, power),
+	TableSlot(nb_floor_divide, binary <Table::OP_IDIV>),
+	TableSlot(nb_and, binary <Table::OP_BAND>),
+	TableSlot(nb_or, binary <Table::OP_BOR>),
+	TableSlot(nb_xor, binary <Table::OP_BXOR>),
+	TableSlot(nb_lshift, binary <Table::OP_SHL>),
+	TableSlot(nb_rshift, binary <Table::OP_SHR>),
+	TableSlot(nb_matrix_multiply, binary <Table::OP_CONCAT>),
+	TableSlot(nb_negative, unary <Table::OP_UNM>),
+	TableSlot(nb_invert, unary <Table::OP_BNOT>),
+	TableSlot(nb_inplace_add, inplace_add),
+	TableSlot(tp_richcompare, richcompare),
+	TableSlot(tp_hash, hash),
+	TableSlot(mp_length, length),
+	TableSlot(mp_subscript, subscript),
+	TableSlot(mp_ass_subscript, ass_subscript),
+	TableSlot(sq_contains, contains),
+	TableSlot(tp_iter, iter),
+);
+ObjDef(LuaPool, "Pool of identical Lua states for use from multiple threads", 0, {Py_tp_new, reinterpret_cast <void *>(LuaPool::create)},);
+
+PyMemberDef Function::members[] = { // {{{
+	{"__vectorcalloffset__", T_PYSSIZET, sizeof(PyObject), READONLY, nullptr},	// Function::vectorcall directly follows PyObject_HEAD.
+	{nullptr, 0, 0, 0, nullptr}
+}; // }}}
+
+// Create the types for a new module object.
+static int module_exec(PyObject *module) { // {{{
+	ModuleState *state = reinterpret_cast <ModuleState *>(PyModule_GetState(module));
+	std::pair <PyTypeObject **, PyType_Spec *> const types[] = {
+		{&state->LuaType, &LuaSpec},
+		{&state->FunctionType, &FunctionSpec},
+		{&state->TableType, &TableSpec},
+		{&state->LuaPoolType, &LuaPoolSpec},
+	};
+	for (auto type: types) {
+		*type.first = reinterpret_cast <PyTypeObject *>(PyType_FromModuleAndSpec(module, type.second, nullptr));
+		if (!*type.first || PyModule_AddType(module, *type.first) < 0)
+			return -1;
+	}
+	state->LimitExceeded = PyErr_NewExceptionWithDoc("lua.LimitExceeded", "Lua code ran out of instructions or time", PyExc_RuntimeError, nullptr);
+	if (!state->LimitExceeded || PyModule_AddObjectRef(module, "LimitExceeded", state->LimitExceeded) < 0)
+		return -1;
+	state->Cancelled = PyErr_NewExceptionWithDoc("lua.Cancelled", "Lua code was stopped by Lua.cancel()", PyExc_RuntimeError, nullptr);
+	if (!state->Cancelled || PyModule_AddObjectRef(module, "Cancelled", state->Cancelled) < 0)
+		return -1;
+	return 0;
+} // }}}
+
+static int module_traverse(PyObject *module, visitproc visit, void *arg) { // {{{
+	ModuleState *state = reinterpret_cast <ModuleState *>(PyModule_GetState(module));
+	Py_VISIT(state->LuaType);
+	Py_VISIT(state->FunctionType);
+	Py_VISIT(state->TableType);
+	Py_VISIT(state->LuaPoolType);
+	Py_VISIT(state->LimitExceeded);
+	Py_VISIT(state->Cancelled);
+	return 0;
+} // }}}
+
+static int module_clear(PyObject *module) { // {{{
+	ModuleState *state = reinterpret_cast <ModuleState *>(PyModule_GetState(module));
+	Py_CLEAR(state->LuaType);
+	Py_CLEAR(state->FunctionType);
+	Py_CLEAR(state->TableType);
+	Py_CLEAR(state->LuaPoolType);
+	Py_CLEAR(state->LimitExceeded);
+	Py_CLEAR(state->Cancelled);
+	return 0;
+} // }}}
+
+static void module_free(void *module) { // {{{
+	module_clear(reinterpret_cast <PyObject *>(module));
+} // }}}
+
+static PyModuleDef_Slot module_slots[] = { // {{{
+	{Py_mod_exec, reinterpret_cast <void *>(module_exec)},
+#if PY_VERSION_HEX >= 0x030c0000
+	// All state is per module and per Lua object, so every interpreter can have its own GIL.
+	{Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#if PY_VERSION_HEX >= 0x030d0000
+	// Every Lua object serializes access to its state with its own mutex (see Lua::Lock), so no GIL is needed.
+	{Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+	{0, nullptr}
+}; // }}}
 
-static PyModuleDef Module = {
+PyModuleDef Module = {
 	// XXX Using .m_base is undocumented, but otherwise C++ does not allow specifying the other identifiers by name.
 	.m_base = PyModuleDef_HEAD_INIT,
 	.m_name = "lua",
 	.m_doc = nullptr,
-	.m_size = -1,	// State is held in global variables
+	.m_size = sizeof(ModuleState),
+	.m_methods = nullptr,
+	.m_slots = module_slots,
+	.m_traverse = module_traverse,
+	.m_clear = module_clear,
+	.m_free = module_free,
 };
 
 extern "C" {
 	PyMODINIT_FUNC PyInit_lua() {
-		if (PyType_Ready(&LuaType) < 0)
-			return nullptr;
-		if (PyType_Ready(&FunctionType) < 0)
-			return nullptr;
-		if (PyType_Ready(&TableType) < 0)
-			return nullptr;
-
-		PyObject *m = PyModule_Create(&Module);
-		if (!m)
-			return nullptr;
-
-		Py_INCREF(&LuaType);
-		Py_INCREF(&FunctionType);
-		Py_INCREF(&TableType);
-
-		if (PyModule_AddObject(m, "Lua", (PyObject *) &LuaType) < 0
-				|| PyModule_AddObject(m, "Function", (PyObject *) &FunctionType) < 0
-				|| PyModule_AddObject(m, "Table", (PyObject *) &TableType) < 0) {
-			Py_DECREF(&LuaType);
-			Py_DECREF(&FunctionType);
-			Py_DECREF(&TableType);
-			Py_DECREF(m);
-			return nullptr;
-		}
-
-		return m;
+		// Multi-phase initialization; the module is created and module_exec is called by the import system.
+		return PyModuleDef_Init(&Module);
 	}
 }
 // }}}
 
 // class Lua implementation. {{{
 // Operator name mappings. {{{
-std::map <char const *, char const *> const Lua::opnames = {
-	std::make_pair("+", "__add__"),
-	std::make_pair("-", "__sub__"),
-	std::make_pair("*", "__mul__"),
-	std::make_pair("/", "__truediv__"),
-	std::make_pair("%", "__mod__"),
-	std::make_pair("^", "__pow__"),
-	std::make_pair("//", "__floordiv__"),
-	std::make_pair("&", "__and__"),
-	std::make_pair("|", "__or__"),
-	std::make_pair("~", "__xor__"),
-	std::make_pair("<<", "__lshift__"),
-	std::make_pair(">>", "__rshift__"),
-	std::make_pair("..", "__matmul__"),
-	std::make_pair("==", "__eq__"),
-	std::make_pair("<", "__lt__"),
-	std::make_pair("<=", "__le__")
-};
-
 std::map <char const *, char const *> const Lua::lua2python = {
 	std::make_pair("__add", "__add__"),
 	std::make_pair("__sub", "__sub__"),
@@ -344,11 +1048,37 @@ std::map <char const *, char const *> const Lua::lua2python = {
 	std::make_pair("__le", "__le__"),
 	std::make_pair("__index", "__getitem__"),
 	std::make_pair("__newindex", "__setitem__"),
-	std::make_pair("__call", "__call__"),
+	//std::make_pair("__call", "__call__"),	// Calls skip the method lookup, so this one is also set outside the loop.
 	std::make_pair("__close", "__close__"),
 	//std::make_pair("__gc", "__gc__"),	// This one is special, so it shouldn't be set through the loop that is used for this list.
 	std::make_pair("__tostring", "__repr__"),
 };
+
+// Operators that can be called through a slot in PyNumberMethods.
+// Unary operators have no fallback: they are only called on the object that owns the slot.
+#define NUMBER_SLOT(lua_name, slot, fallback) {lua_name, offsetof(PyNumberMethods, slot), reinterpret_cast <void *>(fallback)}
+Lua::NumberSlot const Lua::binary_slots[] = {
+	NUMBER_SLOT("__add", nb_add, PyNumber_Add),
+	NUMBER_SLOT("__sub", nb_subtract, PyNumber_Subtract),
+	NUMBER_SLOT("__mul", nb_multiply, PyNumber_Multiply),
+	NUMBER_SLOT("__div", nb_true_divide, PyNumber_TrueDivide),
+	NUMBER_SLOT("__mod", nb_remainder, PyNumber_Remainder),
+	NUMBER_SLOT("__idiv", nb_floor_divide, PyNumber_FloorDivide),
+	NUMBER_SLOT("__band", nb_and, PyNumber_And),
+	NUMBER_SLOT("__bor", nb_or, PyNumber_Or),
+	NUMBER_SLOT("__bxor", nb_xor, PyNumber_Xor),
+	NUMBER_SLOT("__shl", nb_lshift, PyNumber_Lshift),
+	NUMBER_SLOT("__shr", nb_rshift, PyNumber_Rshift),
+	NUMBER_SLOT("__concat", nb_matrix_multiply, PyNumber_MatrixMultiply),
+	{nullptr, 0, nullptr}
+};
+
+Lua::NumberSlot const Lua::unary_slots[] = {
+	{"__unm", offsetof(PyNumberMethods, nb_negative), nullptr},
+	{"__bnot", offsetof(PyNumberMethods, nb_invert), nullptr},
+	{nullptr, 0, nullptr}
+};
+#undef NUMBER_SLOT
 // }}}
 
 // Python-accessible methods. {{{
@@ -357,10 +1087,51 @@ PyMethodDef Lua::methods[] = { // {{{
 	{"run", reinterpret_cast <PyCFunction>(run_method), METH_VARARGS | METH_KEYWORDS, "Run a Lua script"},
 	{"run_file", reinterpret_cast <PyCFunction>(run_file_method), METH_VARARGS | METH_KEYWORDS, "Run a Lua script from a file"},
 	{"module", reinterpret_cast <PyCFunction>(module_method), METH_VARARGS, "Import a module into Lua"},
+	{"chunk_cache_stats", reinterpret_cast <PyCFunction>(chunk_cache_stats_method), METH_NOARGS, "Get statistics of the compiled chunk cache"},
+	{"memory_stats", reinterpret_cast <PyCFunction>(memory_stats_method), METH_NOARGS, "Get memory use of the Lua state"},
+	{"freelist_stats", reinterpret_cast <PyCFunction>(freelist_stats_method), METH_NOARGS, "Get statistics of the Table and Function free lists"},
+	{"last_instructions", reinterpret_cast <PyCFunction>(last_instructions_method), METH_NOARGS, "Get number of instructions run by the last call from this thread, or None if it was not counted"},
+	{"cancel", reinterpret_cast <PyCFunction>(cancel_method), METH_NOARGS, "Stop the Lua code that is running; may be called from any thread"},
+	{"start_profiler", reinterpret_cast <PyCFunction>(start_profiler_method), METH_VARARGS | METH_KEYWORDS, "Start sampling the stack every interval instructions"},
+	{"stop_profiler", reinterpret_cast <PyCFunction>(stop_profiler_method), METH_NOARGS, "Stop the profiler; return the samples as collapsed stacks"},
+	{"stats", reinterpret_cast <PyCFunction>(stats_method), METH_NOARGS, "Get counters and timers for crossings between Lua and Python"},
+	{"reset_stats", reinterpret_cast <PyCFunction>(reset_stats_method), METH_NOARGS, "Reset the counters and timers of stats()"},
+	{nullptr, nullptr, 0, nullptr}
+}; // }}}
+
+// Module for accessing some Python parts from Lua. This is prepared as a "python" module unless disabled. {{{
+PyMethodDef Lua::python_functions[] = { // {{{
+	{"list", python_list, METH_O, "Create list from Lua table"},
+	{"dict", python_dict, METH_O, "Create dict from Lua table"},
+	{"bytes", python_bytes, METH_O, "Create bytes from Lua table, string or anything that bytes() accepts"},
 	{nullptr, nullptr, 0, nullptr}
 }; // }}}
 
+PyObject *Lua::python_list(PyObject *, PyObject *arg) { // {{{
+	return PyObject_CallMethod(arg, "list", nullptr);
+} // }}}
+
+PyObject *Lua::python_dict(PyObject *, PyObject *arg) { // {{{
+	return PyObject_CallMethod(arg, "dict", nullptr);
+} // }}}
+
+PyObject *Lua::python_bytes(PyObject *table_type, PyObject *arg) { // {{{
+	if (PyObject_TypeCheck(arg, reinterpret_cast <PyTypeObject *>(table_type))) {
+		PyObject *list = PyObject_CallMethod(arg, "list", nullptr);	// New reference.
+		if (!list)
+			return nullptr;
+		PyObject *ret = PyBytes_FromObject(list);
+		Py_DECREF(list);
+		return ret;
+	}
+	if (PyUnicode_Check(arg))
+		return PyUnicode_AsUTF8String(arg);
+	return PyObject_CallOneArg(reinterpret_cast <PyObject *>(&PyBytes_Type), arg);
+} // }}}
+// }}}
+
 PyObject *Lua::set_method(Lua *self, PyObject *args) { // {{{
+	Lock lock(self);
 	char const *name;
 	PyObject *value;
 	if (!PyArg_ParseTuple(args, "sO", &name, &value))
@@ -370,38 +1141,66 @@ PyObject *Lua::set_method(Lua *self, PyObject *args) { // {{{
 } // }}}
 
 PyObject *Lua::run_method(Lua *self, PyObject *args, PyObject *keywords) { // {{{
-	char const *code;
+	Lock lock(self);
+	PyObject *code = Py_None;
 	char const *description = nullptr;
-	bool keep_single = false;
+	int keep_single = false;
 	char const *var = nullptr;
-	PyObject *value = nullptr;
-	char const *keywordnames[] = {"code", "description", "keep_single", "var", "value", nullptr};
-	if (!PyArg_ParseTupleAndKeywords(args, keywords, "s|ssOp", const_cast <char **>(keywordnames), &code, &description, &var, &value, &keep_single))
+	PyObject *value = Py_None;
+	Py_ssize_t max_instructions = 0;
+	double timeout = 0;
+	char const *keywordnames[] = {"code", "description", "keep_single", "var", "value", "max_instructions", "timeout", nullptr};
+	if (!PyArg_ParseTupleAndKeywords(args, keywords, "|OzpzO$nd", const_cast <char **>(keywordnames), &code, &description, &keep_single, &var, &value, &max_instructions, &timeout))
 		return nullptr;
-	if (!description)
-		description = code;
 	if (var)
 		self->set(var, value);
-	return self->run(code, description, keep_single);
+	if (code == Py_None)
+		Py_RETURN_NONE;
+	Limits limits(self, max_instructions, timeout);
+
+	// A str is used as UTF-8, a bytes-like object is used in place; neither is copied.
+	if (PyUnicode_Check(code)) {
+		Py_ssize_t size;
+		char const *source = PyUnicode_AsUTF8AndSize(code, &size);
+		if (!source)
+			return nullptr;
+		return self->run(std::string_view(source, size), description ? description : source, keep_single);
+	}
+	if (PyObject_CheckBuffer(code)) {
+		Py_buffer view;
+		if (PyObject_GetBuffer(code, &view, PyBUF_SIMPLE) < 0)
+			return nullptr;
+		PyObject *ret = self->run(std::string_view(reinterpret_cast <char const *>(view.buf), view.len), description ? description : "python buffer", keep_single);
+		PyBuffer_Release(&view);
+		return ret;
+	}
+
+	// Anything else must be a file-like object or an iterator that provides the code in parts.
+	return self->run_stream(code, description ? description : "python stream", keep_single);
 } // }}}
 
 PyObject *Lua::run_file_method(Lua *self, PyObject *args, PyObject *keywords) { // {{{
+	Lock lock(self);
 	char const *filename;
 	char const *description = nullptr;
-	bool keep_single = false;
+	int keep_single = false;
 	char const *var = nullptr;
-	PyObject *value = nullptr;
-	char const *keywordnames[] = {"filename", "description", "keep_single", "var", "value", nullptr};
-	if (!PyArg_ParseTupleAndKeywords(args, keywords, "s|ssOp", const_cast <char **>(keywordnames), &filename, &description, &var, &value, &keep_single))
+	PyObject *value = Py_None;
+	Py_ssize_t max_instructions = 0;
+	double timeout = 0;
+	char const *keywordnames[] = {"filename", "description", "keep_single", "var", "value", "max_instructions", "timeout", nullptr};
+	if (!PyArg_ParseTupleAndKeywords(args, keywords, "s|zpzO$nd", const_cast <char **>(keywordnames), &filename, &description, &keep_single, &var, &value, &max_instructions, &timeout))
 		return nullptr;
 	if (!description)
 		description = filename;
 	if (var)
 		self->set(var, value);
+	Limits limits(self, max_instructions, timeout);
 	return self->run_file(filename, description, keep_single);
 } // }}}
 
 PyObject *Lua::module_method(Lua *self, PyObject *args) { // {{{
+	Lock lock(self);
 	char const *name;
 	PyObject *dict;
 	if (!PyArg_ParseTuple(args, "sO", &name, &dict))
@@ -409,108 +1208,1128 @@ PyObject *Lua::module_method(Lua *self, PyObject *args) { // {{{
 	self->load_module(name, dict);
 	Py_RETURN_NONE;
 } // }}}
+
+PyObject *Lua::chunk_cache_stats_method(Lua *self, PyObject *) { // {{{
+	Lock lock(self);
+	return Py_BuildValue("{sn sn sn sn sn}",
+			"size", Py_ssize_t(self->chunks.size()),
+			"capacity", self->chunk_cache_size,
+			"hits", self->chunk_hits,
+			"misses", self->chunk_misses,
+			"evictions", self->chunk_evictions);
+} // }}}
+
+PyObject *Lua::memory_stats_method(Lua *self, PyObject *) { // {{{
+	Lock lock(self);
+	return self->allocator.stats();
+} // }}}
+
+PyObject *Lua::freelist_stats_method(Lua *self, PyObject *) { // {{{
+	Lock lock(self);
+	return Py_BuildValue("{sN sN}",
+			"Table", self->table_freelist.stats(),
+			"Function", self->function_freelist.stats());
+} // }}}
+
+PyObject *Lua::last_instructions_method(Lua *self, PyObject *) { // {{{
+	Lock lock(self);
+	auto last = self->last_instructions.find(std::this_thread::get_id());
+	if (last == self->last_instructions.end() || last->second < 0)
+		Py_RETURN_NONE;
+	return PyLong_FromLongLong(last->second);
+} // }}}
+
+PyObject *Lua::cancel_method(Lua *self, PyObject *) { // {{{
+	// This does not take the lock, because the thread that runs the code holds it.
+	// lua_sethook() is safe to call while the state is running, as Lua allows it from signal handlers.
+	// The main state is armed as well, because the error from a cancelled coroutine may be caught by resume().
+	std::lock_guard <std::mutex> guard(self->current_mutex);
+	if (self->running == 0)
+		Py_RETURN_FALSE;
+	self->cancel_requested = true;
+	lua_sethook(self->state, hook, LUA_MASKCOUNT, 1);
+	if (self->current != self->state)
+		lua_sethook(self->current, hook, LUA_MASKCOUNT, 1);
+	Py_RETURN_TRUE;
+} // }}}
+
+PyObject *Lua::start_profiler_method(Lua *self, PyObject *args, PyObject *keywords) { // {{{
+	Lock lock(self);
+	int interval = 1000;
+	char const *keywordnames[] = {"interval", nullptr};
+	if (!PyArg_ParseTupleAndKeywords(args, keywords, "|i", const_cast <char **>(keywordnames), &interval))
+		return nullptr;
+	if (interval < 1) {
+		PyErr_SetString(PyExc_ValueError, "interval must be at least 1");
+		return nullptr;
+	}
+	self->profile.clear();
+	self->since_sample = 0;
+	self->profile_interval = interval;
+	self->update_hook();
+	Py_RETURN_NONE;
+} // }}}
+
+PyObject *Lua::stop_profiler_method(Lua *self, PyObject *) { // {{{
+	Lock lock(self);
+	self->profile_interval = 0;
+	self->update_hook();
+
+	// One line per stack, in the format of flamegraph.pl: frames from the root, separated by ';', then the count.
+	std::vector <std::pair <std::string, long long> > stacks(self->profile.begin(), self->profile.end());
+	std::sort(stacks.begin(), stacks.end());
+	std::string ret;
+	for (auto &stack: stacks)
+		ret += stack.first + ' ' + std::to_string(stack.second) + '\n';
+	self->profile.clear();
+	return PyUnicode_FromStringAndSize(ret.data(), ret.size());
+} // }}}
+
+PyObject *Lua::stats_method(Lua *self, PyObject *) { // {{{
+	Lock lock(self);
+	return self->stats.get();
+} // }}}
+
+PyObject *Lua::reset_stats_method(Lua *self, PyObject *) { // {{{
+	Lock lock(self);
+	self->stats.reset();
+	Py_RETURN_NONE;
+} // }}}
+
+PyObject *Lua::Stats::get() const { // {{{
+#ifdef PYTHON_LUA_STATS
+	static char const *const push_names[NUM_PUSH_KINDS] = {"None", "bool", "int", "str", "float", "Table", "Function", "object"};
+	static char const *const lua_names[LUA_NUMTYPES] = {"nil", "boolean", "lightuserdata", "number", "string", "table", "function", "userdata", "thread"};
+	PyObject *push_counts = PyDict_New();
+	PyObject *conversion_counts = PyDict_New();
+	PyObject *callback_counts = PyDict_New();
+	if (!push_counts || !conversion_counts || !callback_counts) {
+		Py_XDECREF(push_counts);
+		Py_XDECREF(conversion_counts);
+		Py_XDECREF(callback_counts);
+		return nullptr;
+	}
+	bool ok = true;
+	auto add = [&ok](PyObject *dict, char const *key, long long value) {
+		PyObject *count = PyLong_FromLongLong(value);	// New reference.
+		if (!count || PyDict_SetItemString(dict, key, count) < 0)
+			ok = false;
+		Py_XDECREF(count);
+	};
+	for (int i = 0; i < NUM_PUSH_KINDS; ++i)
+		add(push_counts, push_names[i], pushes[i]);
+	for (int i = 0; i < LUA_NUMTYPES; ++i)
+		add(conversion_counts, lua_names[i], conversions[i]);
+	for (auto &callback: callbacks)
+		add(callback_counts, callback.first.c_str(), callback.second);
+	if (!ok) {
+		Py_DECREF(push_counts);
+		Py_DECREF(conversion_counts);
+		Py_DECREF(callback_counts);
+		return nullptr;
+	}
+	typedef std::chrono::nanoseconds ns;
+	return Py_BuildValue("{sN sN sN sL sL sL sL sL}",
+			"push", push_counts,
+			"to_python", conversion_counts,
+			"callbacks", callback_counts,
+			"finalizers", finalizers,
+			"refs_created", refs,
+			"refs_released", unrefs,
+			"lua_ns", (long long)std::chrono::duration_cast <ns>(lua_time).count(),
+			"python_ns", (long long)std::chrono::duration_cast <ns>(python_time).count());
+#else
+	PyErr_SetString(PyExc_RuntimeError, "statistics are not compiled in; build with PYTHON_LUA_STATS=1");
+	return nullptr;
+#endif
+} // }}}
 // }}}
 
 // Lua callback for all userdata metamethods. (Method selection is done via operator name stored in upvalue.)
 int Lua::metamethod(lua_State *state) { // {{{
 	// This function is called from Lua through a metatable.
-	// Get self pointer.
-	lua_getfield(state, LUA_REGISTRYINDEX, "self");
-	Lua *lua = reinterpret_cast <Lua *> (lua_touserdata(state, -1));
-	lua_pop(state, 1);
+	Lua *lua = owner(state);
+	PyThreadState *thread = lua->enter_python(state);
 
-	// 1 upvalues: python method name.
-	char const *python_op = lua_tostring(state, lua_upvalueindex(1));
+	// 1 upvalue: python method name as interned str, or NULL to call the target directly.
+	PyObject *python_op = reinterpret_cast <PyObject *>(lua_touserdata(state, lua_upvalueindex(1)));
 
-	PyObject *target = lua->to_python(1);
-	PyObject *method = PyMapping_GetItemString(target, python_op);
-
-	// Create arguments tuple
+	// Convert arguments; the first one is the target object.
+	// Short argument lists are kept on the C stack, so the common case does not allocate.
 	int nargs = lua_gettop(state);
-	PyObject *args = PyTuple_New(nargs - 1);
-	for (int i = 2; i <= nargs; ++i) {
-		PyObject *arg = lua->to_python(i);
-		// fill tuple
-		PyTuple_SET_ITEM(args, i - 2, arg);	// Steals reference to arg.
+	PyObject *small_args[max_stack_args];
+	PyObject **args = nargs <= max_stack_args ? small_args : PyMem_New(PyObject *, nargs);
+	if (!args) {
+		PyErr_NoMemory();
+		return python_error(state, thread);
+	}
+	for (int i = 0; i < nargs; ++i) {
+		args[i] = lua->to_python(i + 1);	// New reference.
+		if (!args[i]) {
+			while (i > 0)
+				Py_DECREF(args[--i]);
+			if (args != small_args)
+				PyMem_Free(args);
+			return python_error(state, thread);
+		}
 	}
 
 	// Call function.
-	lua->push(PyObject_CallObject(method, args));
-	Py_DECREF(args);
+	PyObject *result;
+	if (python_op)
+		result = PyObject_VectorcallMethod(python_op, args, nargs, nullptr);
+	else
+		result = PyObject_Vectorcall(args[0], args + 1, (nargs - 1) | PY_VECTORCALL_ARGUMENTS_OFFSET, nullptr);
+	for (int i = 0; i < nargs; ++i)
+		Py_DECREF(args[i]);
+	if (args != small_args)
+		PyMem_Free(args);
+
+	if (!result)
+		return python_error(state, thread);
+	lua->push(result);
+	Py_DECREF(result);
+	lua->leave_python(thread);
 	return 1;
 } // }}}
 
-int Lua::gc(lua_State *state) { // {{{
-	lua_getfield(state, LUA_REGISTRYINDEX, "self");
-	PyObject *obj = reinterpret_cast <PyObject *>(lua_touserdata(state, -1));
-	lua_pop(state, 1);
-	Py_DECREF(obj);
+// Lua callbacks that call a Python type slot directly. {{{
+int Lua::unary_slot(lua_State *state) { // {{{
+	Lua *lua = owner(state);
+	PyThreadState *thread = lua->enter_python(state);
+	unaryfunc slot = reinterpret_cast <unaryfunc>(lua_touserdata(state, lua_upvalueindex(1)));
+	PyObject *a;
+	if (!lua->slot_arguments(1, &a))
+		return python_error(state, thread);
+	PyObject *result = slot(a);
+	Py_DECREF(a);
+	if (!result)
+		return python_error(state, thread);
+	lua->push(result);
+	Py_DECREF(result);
+	lua->leave_python(thread);
+	return 1;
+} // }}}
+
+int Lua::binary_slot(lua_State *state) { // {{{
+	// Binary slots take the operands in their original order, regardless of which one owns the slot.
+	Lua *lua = owner(state);
+	PyThreadState *thread = lua->enter_python(state);
+	binaryfunc slot = reinterpret_cast <binaryfunc>(lua_touserdata(state, lua_upvalueindex(1)));
+	PyObject *args[2];
+	if (!lua->slot_arguments(2, args))
+		return python_error(state, thread);
+	PyObject *a = args[0], *b = args[1];
+	PyObject *result = slot(a, b);
+	if (result == Py_NotImplemented) {
+		// Let the abstract API try the other operand, or raise the proper TypeError.
+		Py_DECREF(result);
+		binaryfunc fallback = reinterpret_cast <binaryfunc>(lua_touserdata(state, lua_upvalueindex(2)));
+		result = fallback(a, b);
+	}
+	Py_DECREF(a);
+	Py_DECREF(b);
+	if (!result)
+		return python_error(state, thread);
+	lua->push(result);
+	Py_DECREF(result);
+	lua->leave_python(thread);
+	return 1;
+} // }}}
+
+int Lua::power_slot(lua_State *state) { // {{{
+	Lua *lua = owner(state);
+	PyThreadState *thread = lua->enter_python(state);
+	ternaryfunc slot = reinterpret_cast <ternaryfunc>(lua_touserdata(state, lua_upvalueindex(1)));
+	PyObject *args[2];
+	if (!lua->slot_arguments(2, args))
+		return python_error(state, thread);
+	PyObject *a = args[0], *b = args[1];
+	PyObject *result = slot(a, b, Py_None);
+	if (result == Py_NotImplemented) {
+		Py_DECREF(result);
+		result = PyNumber_Power(a, b, Py_None);
+	}
+	Py_DECREF(a);
+	Py_DECREF(b);
+	if (!result)
+		return python_error(state, thread);
+	lua->push(result);
+	Py_DECREF(result);
+	lua->leave_python(thread);
+	return 1;
+} // }}}
+
+int Lua::length_slot(lua_State *state) { // {{{
+	Lua *lua = owner(state);
+	PyThreadState *thread = lua->enter_python(state);
+	lenfunc slot = reinterpret_cast <lenfunc>(lua_touserdata(state, lua_upvalueindex(1)));
+	PyObject *a;
+	if (!lua->slot_arguments(1, &a))
+		return python_error(state, thread);
+	Py_ssize_t result = slot(a);
+	Py_DECREF(a);
+	if (result < 0 && PyErr_Occurred())
+		return python_error(state, thread);
+	lua->leave_python(thread);
+	lua_pushinteger(state, result);
+	return 1;
+} // }}}
+
+int Lua::compare_slot(lua_State *state) { // {{{
+	// Upvalue 1 is the type, upvalue 2 is the comparison operator.
+	Lua *lua = owner(state);
+	PyThreadState *thread = lua->enter_python(state);
+	PyTypeObject *type = reinterpret_cast <PyTypeObject *>(lua_touserdata(state, lua_upvalueindex(1)));
+	int op = lua_tointeger(state, lua_upvalueindex(2));
+	PyObject *args[2];
+	if (!lua->slot_arguments(2, args))
+		return python_error(state, thread);
+	PyObject *a = args[0], *b = args[1];
+	// Unlike the number slots, tp_richcompare expects its owner as the first argument.
+	static int const swapped[] = {Py_GT, Py_GE, Py_EQ, Py_NE, Py_LT, Py_LE};
+	PyObject *result = PyObject_TypeCheck(a, type) ? type->tp_richcompare(a, b, op) : type->tp_richcompare(b, a, swapped[op]);
+	if (result == Py_NotImplemented) {
+		Py_DECREF(result);
+		result = PyObject_RichCompare(a, b, op);
+	}
+	Py_DECREF(a);
+	Py_DECREF(b);
+	if (!result)
+		return python_error(state, thread);
+	lua->push(result);
+	Py_DECREF(result);
+	lua->leave_python(thread);
+	return 1;
+} // }}}
+
+int Lua::setitem_slot(lua_State *state) { // {{{
+	Lua *lua = owner(state);
+	PyThreadState *thread = lua->enter_python(state);
+	objobjargproc slot = reinterpret_cast <objobjargproc>(lua_touserdata(state, lua_upvalueindex(1)));
+	PyObject *args[3];
+	if (!lua->slot_arguments(3, args))
+		return python_error(state, thread);
+	int result = slot(args[0], args[1], args[2]);
+	for (PyObject *arg: args)
+		Py_DECREF(arg);
+	if (result < 0)
+		return python_error(state, thread);
+	lua->leave_python(thread);
 	return 0;
 } // }}}
+// }}}
 
-// class Lua __new__ function.
-PyObject *Lua::create(PyTypeObject *type, PyObject *args, PyObject *kwds) { // {{{
-	Lua *self = reinterpret_cast <Lua *>(type->tp_alloc(type, 0));
-	if (!self)
-		return nullptr;
-	return reinterpret_cast <PyObject *>(self);
+bool Lua::slot_arguments(int n, PyObject **args) { // {{{
+	for (int i = 0; i < n; ++i) {
+		args[i] = to_python(i + 1);	// New reference.
+		if (!args[i]) {
+			while (i > 0)
+				Py_DECREF(args[--i]);
+			return false;
+		}
+	}
+	return true;
 } // }}}
 
-// Destructor.
-void Lua::dealloc(Lua *self) { // {{{
-	lua_close(self->state);
-	LuaType.tp_free(reinterpret_cast <PyObject *>(self));
+int Lua::python_error(lua_State *state, PyThreadState *thread) { // {{{
+	// Pass the Python exception on to Lua as an error.
+	PyObject *type, *value, *traceback;
+	PyErr_Fetch(&type, &value, &traceback);
+	PyObject *message = value ? PyObject_Str(value) : nullptr;
+	char const *text = message ? PyUnicode_AsUTF8(message) : nullptr;
+	lua_pushstring(state, text ? text : "error in Python callback");
+	PyErr_Clear();
+	Py_XDECREF(message);
+	Py_XDECREF(type);
+	Py_XDECREF(value);
+	Py_XDECREF(traceback);
+	owner(state)->leave_python(thread);
+	return lua_error(state);
 } // }}}
 
-// set variable in Lua.
-void Lua::set(std::string const &name, PyObject *value) { // {{{
-	lua_rawgeti(state, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
-	push(value);
-	lua_setfield(state, -2, name.c_str());
-	lua_settop(state, -2);
+int Lua::gc(lua_State *state) { // {{{
+	// The data block of the userdata stores the PyObject *.
+	Lua *lua = owner(state);
+	PyThreadState *thread = lua->enter_python(state);
+	PyObject *obj = *reinterpret_cast <PyObject **>(lua_touserdata(state, 1));
+	Py_DECREF(obj);
+	lua->stats.finalizer();
+	lua->leave_python(thread);
+	return 0;
 } // }}}
 
-// run code after having loaded the buffer (internal use only).
-PyObject *Lua::run_code(int pos, bool keep_single) { // {{{
-	lua_call(state, 0, LUA_MULTRET);
-	int size = lua_gettop(state) - pos;
-	PyObject *ret;
-	if (keep_single || size > 1) {
-		ret = PyTuple_New(size);
-		for (int i = 0; i < size; ++i)
-			PyTuple_SET_ITEM(ret, i, to_python(-size + i));
+// Memory allocation. {{{
+void *Lua::Allocator::allocate(size_t size) { // {{{
+	if (!use_slabs || size > max_small)
+		return std::malloc(size);
+	size_t cls = size_class(size);
+	FreeBlock *block = free_lists[cls];
+	if (block) {
+		free_lists[cls] = block->next;
+		return block;
 	}
-	else if (size == 1)
-		ret = to_python(-1);
-	else
-		ret = Py_None;
-	lua_settop(state, pos);
+	// Cut a new block from the newest slab, starting a new slab if it is used up.
+	size_t block_size = (cls + 1) * granularity;
+	if (unused_size < block_size) {
+		void *slab = std::malloc(slab_size);
+		if (!slab)
+			return nullptr;
+		try {
+			slabs.push_back(slab);
+		}
+		catch (std::bad_alloc const &) {
+			std::free(slab);
+			return nullptr;
+		}
+		unused = static_cast <char *>(slab);
+		unused_size = slab_size;
+	}
+	void *ret = unused;
+	unused += block_size;
+	unused_size -= block_size;
 	return ret;
 } // }}}
 
-// run string in lua.
-PyObject *Lua::run(std::string const &cmd, std::string const &description, bool keep_single) { // {{{
-	int pos = lua_gettop(state);
-	if (luaL_loadbufferx(state, cmd.data(), cmd.size(), description.c_str(), nullptr) != LUA_OK) {
-		PyErr_SetString(PyExc_ValueError, lua_tolstring(state, 1, nullptr));
-		return nullptr;
+void Lua::Allocator::release(void *block, size_t size) { // {{{
+	if (!use_slabs || size > max_small) {
+		std::free(block);
+		return;
 	}
-	return run_code(pos, keep_single);
+	// Blocks are never returned to the system before the state is closed; they are reused for the same size class.
+	size_t cls = size_class(size);
+	FreeBlock *free_block = static_cast <FreeBlock *>(block);
+	free_block->next = free_lists[cls];
+	free_lists[cls] = free_block;
 } // }}}
 
-// run file in lua.
-PyObject *Lua::run_file(std::string const &filename, std::string const &description, bool keep_single) { // {{{
-	int pos = lua_gettop(state);
-	if (luaL_loadfilex(state, filename.c_str(), nullptr) != LUA_OK) {
-		PyErr_SetString(PyExc_ValueError, lua_tolstring(state, 1, nullptr));
+void *Lua::Allocator::alloc(void *ud, void *ptr, size_t osize, size_t nsize) { // {{{
+	// See the description of lua_Alloc in the Lua manual. If ptr is NULL, osize is not a size.
+	Allocator *self = static_cast <Allocator *>(ud);
+	if (!ptr)
+		osize = 0;
+	if (nsize == 0) {
+		if (ptr) {
+			self->release(ptr, osize);
+			self->current -= osize;
+			self->frees += 1;
+		}
 		return nullptr;
 	}
-	return run_code(pos, keep_single);
-} // }}}
-
-// load module into lua.
-void Lua::load_module(std::string const &name, PyObject *dict) { // {{{
-	if (!PyDict_Check(dict)) {
+	// Only check the counter, so the check is cheap; a collection is only done when the limit is hit.
+	if (self->enforce_limit && self->limit > 0 && nsize > osize && self->current - osize + nsize > self->limit)
+		return nullptr;
+	void *ret;
+	if (!ptr)
+		ret = self->allocate(nsize);
+	else {
+		bool old_small = self->use_slabs && osize <= max_small;
+		bool new_small = self->use_slabs && nsize <= max_small;
+		if (!old_small && !new_small)
+			ret = std::realloc(ptr, nsize);
+		else if (old_small && new_small && size_class(osize) == size_class(nsize))
+			ret = ptr;
+		else if (nsize <= osize && new_small && !self->free_lists[size_class(nsize)]) {
+			// Lua assumes that shrinking never fails, so keep the block instead of cutting a new one, which could
+			// need a new slab. A block that is larger than its size class is harmless. A block from malloc is
+			// handed to the slabs, so it is freed with them; if even that fails, it is only lost when the state is closed.
+			if (!old_small) {
+				try {
+					self->slabs.push_back(ptr);
+				}
+				catch (std::bad_alloc const &) {
+				}
+			}
+			ret = ptr;
+		}
+		else {
+			ret = self->allocate(nsize);
+			if (ret) {
+				std::memcpy(ret, ptr, std::min(osize, nsize));
+				self->release(ptr, osize);
+			}
+		}
+	}
+	if (!ret)
+		return nullptr;
+	if (!ptr)
+		self->allocations += 1;
+	self->current += nsize - osize;
+	self->peak = std::max(self->peak, self->current);
+	return ret;
+} // }}}
+
+PyObject *Lua::Freelist::alloc(PyTypeObject *type) { // {{{
+	if (objects.empty()) {
+		++allocated;
+		return PyType_GenericAlloc(type, 0);
+	}
+	++reused;
+	PyObject *obj = objects.back();
+	objects.pop_back();
+	// This sets the type (with a new reference) and the reference count, like tp_alloc does.
+	return PyObject_Init(obj, type);
+} // }}}
+
+void Lua::Freelist::free(PyObject *obj) { // {{{
+	if (objects.size() < capacity) {
+		++kept;
+		objects.push_back(obj);
+	}
+	else {
+		++released;
+		Py_TYPE(obj)->tp_free(obj);
+	}
+} // }}}
+
+PyObject *Lua::Freelist::stats() const { // {{{
+	return Py_BuildValue("{sn sn sn sn sn sn}",
+			"size", Py_ssize_t(objects.size()),
+			"capacity", Py_ssize_t(capacity),
+			"reused", reused,
+			"allocated", allocated,
+			"kept", kept,
+			"released", released);
+} // }}}
+
+PyObject *Lua::Allocator::stats() const { // {{{
+	return Py_BuildValue("{sn sn sn sn sn}",
+			"current", Py_ssize_t(current),
+			"peak", Py_ssize_t(peak),
+			"allocations", Py_ssize_t(allocations),
+			"frees", Py_ssize_t(frees),
+			"limit", Py_ssize_t(limit));
+} // }}}
+
+void Lua::error_to_python(int status) { // {{{
+	char const *message = lua_tostring(state, -1);
+	if (limit_hit)
+		PyErr_SetString(limit_hit == cancelled ? types->Cancelled : types->LimitExceeded, limit_hit);
+	else if (status == LUA_ERRMEM)
+		PyErr_SetString(PyExc_MemoryError, message ? message : "not enough memory");
+	else
+		PyErr_SetString(PyExc_ValueError, message ? message : "error object is not a string");
+	lua_pop(state, 1);
+} // }}}
+
+// Execution limits. {{{
+char const Lua::cancelled[] = "cancelled";
+
+void Lua::update_hook() { // {{{
+	// A budget below the interval is checked at its own size, so it cannot be overrun by a whole interval.
+	hook_count = counting ? hook_interval : 0;
+	if (counting && max_instructions > 0 && max_instructions < hook_count)
+		hook_count = int(max_instructions);
+	if (profile_interval > 0)
+		hook_count = hook_count ? std::gcd(hook_count, profile_interval) : profile_interval;
+	// Other coroutines get the new hook when they are resumed.
+	for (lua_State *thread: {state, current}) {
+		if (hook_count > 0)
+			lua_sethook(thread, hook, LUA_MASKCOUNT, hook_count);
+		else
+			lua_sethook(thread, nullptr, 0, 0);
+	}
+} // }}}
+
+void Lua::hook(lua_State *state, lua_Debug *) { // {{{
+	// This runs without the GIL, so it must not use Python.
+	Lua *lua = owner(state);
+	if (!lua->limit_hit && lua->cancel_requested.load(std::memory_order_relaxed)) {
+		lua->limit_hit = cancelled;
+		lua_sethook(state, hook, LUA_MASKCOUNT, 1);
+	}
+	if (!lua->limit_hit) {
+		if (lua->hook_count == 0) {
+			// The hook was armed by a cancel() that came too late.
+			lua->update_hook();
+			return;
+		}
+		if (lua->profile_interval > 0) {
+			lua->since_sample += lua->hook_count;
+			if (lua->since_sample >= lua->profile_interval) {
+				lua->since_sample = 0;
+				lua->sample(state);
+			}
+		}
+		if (!lua->counting)
+			return;
+		lua->instructions += lua->hook_count;
+		if (lua->max_instructions > 0 && lua->instructions > lua->max_instructions)
+			lua->limit_hit = "instruction limit exceeded";
+		else if (lua->deadline != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= lua->deadline)
+			lua->limit_hit = "timeout";
+		else
+			return;
+		// From now on, fail on every instruction, so the error cannot be caught by looping around pcall.
+		lua_sethook(state, hook, LUA_MASKCOUNT, 1);
+	}
+	lua_pushstring(state, lua->limit_hit);
+	lua_error(state);
+} // }}}
+
+void Lua::sample(lua_State *state) { // {{{
+	// Collect frame names from the innermost frame outwards.
+	std::vector <std::string> frames;
+	size_t boundary = python_frames.size();
+	lua_Debug ar;
+	for (int level = 0; lua_getstack(state, level, &ar); ++level) {
+		lua_getinfo(state, "Snf", &ar);
+		lua_CFunction function = lua_tocfunction(state, -1);
+		lua_pop(state, 1);
+		// A callback into Python is the caller of the Python frames that called back into Lua.
+		bool callback = function == metamethod || function == unary_slot || function == binary_slot || function == power_slot || function == length_slot || function == compare_slot || function == setitem_slot || function == gc;
+		if (callback && boundary > 1)
+			frames.push_back(python_frames[--boundary].second);
+		char buffer[LUA_IDSIZE + 100];
+		if (*ar.what == 'C')
+			std::snprintf(buffer, sizeof(buffer), "%s", ar.name ? ar.name : "[C]");
+		else if (*ar.what == 'm')
+			std::snprintf(buffer, sizeof(buffer), "main chunk (%s)", ar.short_src);
+		else
+			std::snprintf(buffer, sizeof(buffer), "%s (%s:%d)", ar.name ? ar.name : "?", ar.short_src, ar.linedefined);
+		std::string name(buffer);
+		std::replace(name.begin(), name.end(), ';', ':');
+		frames.push_back(name);
+	}
+	// The Python frames that made the outermost call are the root.
+	if (boundary > 0)
+		frames.push_back(python_frames[0].second);
+
+	std::string stack;
+	for (auto frame = frames.rbegin(); frame != frames.rend(); ++frame) {
+		if (frame->empty())
+			continue;
+		if (!stack.empty())
+			stack += ';';
+		stack += *frame;
+	}
+	profile[stack] += 1;
+} // }}}
+
+std::pair <PyFrameObject *, std::string> Lua::python_stack() { // {{{
+	PyFrameObject *current = PyEval_GetFrame();	// Borrowed reference.
+	PyFrameObject *base = python_frames.empty() ? nullptr : python_frames.back().first;
+	std::vector <std::string> names;
+	PyFrameObject *frame = current;
+	Py_XINCREF(frame);
+	while (frame && frame != base) {
+		PyCodeObject *code = PyFrame_GetCode(frame);	// New reference.
+		PyObject *name = PyObject_GetAttrString(reinterpret_cast <PyObject *>(code), "co_qualname");	// New reference.
+		char const *text = name ? PyUnicode_AsUTF8(name) : nullptr;
+		std::string label = std::string("py:") + (text ? text : "?");
+		std::replace(label.begin(), label.end(), ';', ':');
+		names.push_back(label);
+		PyErr_Clear();
+		Py_XDECREF(name);
+		Py_DECREF(code);
+		PyFrameObject *back = PyFrame_GetBack(frame);	// New reference.
+		Py_DECREF(frame);
+		frame = back;
+	}
+	Py_XDECREF(frame);
+	std::string stack;
+	for (auto name = names.rbegin(); name != names.rend(); ++name) {
+		if (!stack.empty())
+			stack += ';';
+		stack += *name;
+	}
+	return std::make_pair(current, stack);
+} // }}}
+
+Lua::Limits::Limits(Lua *lua, Py_ssize_t max_instructions, double timeout) : lua(lua), outer(lua->call_depth++ == 0) { // {{{
+	// Calls from Python callbacks into the same state run under the limits of the outermost call.
+	if (!outer)
+		return;
+	lua->limit_hit = nullptr;
+	lua->instructions = 0;
+	lua->max_instructions = max_instructions;
+	lua->deadline = std::chrono::steady_clock::time_point::max();
+	if (timeout > 0)
+		lua->deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast <std::chrono::steady_clock::duration>(std::chrono::duration <double>(timeout));
+	lua->counting = max_instructions > 0 || timeout > 0 || lua->count_instructions;
+	if (lua->counting)
+		lua->update_hook();
+} // }}}
+
+Lua::Limits::~Limits() { // {{{
+	--lua->call_depth;
+	if (!outer)
+		return;
+	lua->last_instructions[std::this_thread::get_id()] = lua->counting ? lua->instructions : -1;
+	if (lua->counting) {
+		lua->counting = false;
+		lua->update_hook();
+	}
+	lua->limit_hit = nullptr;
+} // }}}
+// }}}
+
+// Coroutines. {{{
+int Lua::resume_thread(lua_State *caller, lua_State *co, int nargs) { // {{{
+	if (!lua_checkstack(co, nargs)) {
+		lua_pushliteral(caller, "too many arguments to resume");
+		return -1;
+	}
+	lua_xmove(caller, co, nargs);
+	// The coroutine may have been created before the current hook was installed.
+	lua_sethook(co, lua_gethook(caller), lua_gethookmask(caller), lua_gethookcount(caller));
+	{
+		std::lock_guard <std::mutex> guard(current_mutex);
+		current = co;
+		if (cancel_requested)
+			lua_sethook(co, hook, LUA_MASKCOUNT, 1);
+	}
+	int nresults;
+	int status = lua_resume(co, caller, nargs, &nresults);
+	{
+		std::lock_guard <std::mutex> guard(current_mutex);
+		current = caller;
+		// A limit or cancel that stopped the coroutine also stops the caller, so resume() cannot catch it.
+		if (limit_hit || cancel_requested)
+			lua_sethook(caller, hook, LUA_MASKCOUNT, 1);
+	}
+	if (!limit_hit && cancel_requested)
+		limit_hit = cancelled;
+	if (limit_hit) {
+		// Raise it here too: after a tail call, the caller may not run another instruction.
+		lua_pushstring(caller, limit_hit);
+		return lua_error(caller);
+	}
+	if (status != LUA_OK && status != LUA_YIELD) {
+		lua_xmove(co, caller, 1);
+		return -1;
+	}
+	if (!lua_checkstack(caller, nresults + 1)) {
+		lua_pop(co, nresults);
+		lua_pushliteral(caller, "too many results to resume");
+		return -1;
+	}
+	lua_xmove(co, caller, nresults);
+	return nresults;
+} // }}}
+
+int Lua::coroutine_resume(lua_State *state) { // {{{
+	// Replacement for coroutine.resume().
+	lua_State *co = lua_tothread(state, 1);
+	luaL_argexpected(state, co, 1, "coroutine");
+	int nresults = owner(state)->resume_thread(state, co, lua_gettop(state) - 1);
+	if (nresults < 0) {
+		lua_pushboolean(state, false);
+		lua_insert(state, -2);
+		return 2;
+	}
+	lua_pushboolean(state, true);
+	lua_insert(state, -(nresults + 1));
+	return nresults + 1;
+} // }}}
+
+int Lua::coroutine_wrap(lua_State *state) { // {{{
+	// Replacement for coroutine.wrap().
+	luaL_checktype(state, 1, LUA_TFUNCTION);
+	lua_State *co = lua_newthread(state);
+	lua_pushvalue(state, 1);
+	lua_xmove(state, co, 1);
+	lua_pushcclosure(state, wrapped_coroutine, 1);
+	return 1;
+} // }}}
+
+int Lua::wrapped_coroutine(lua_State *state) { // {{{
+	// The function returned by coroutine_wrap(); this is auxwrap() in lcorolib.c.
+	lua_State *co = lua_tothread(state, lua_upvalueindex(1));
+	int nresults = owner(state)->resume_thread(state, co, lua_gettop(state));
+	if (nresults >= 0)
+		return nresults;
+	int status = lua_status(co);
+	if (status != LUA_OK && status != LUA_YIELD) {
+		// Close the to-be-closed variables of the dead coroutine.
+#if LUA_VERSION_RELEASE_NUM >= 50406
+		status = lua_closethread(co, state);
+		lua_xmove(co, state, 1);
+#elif LUA_VERSION_RELEASE_NUM >= 50404
+		status = lua_resetthread(co);
+		lua_xmove(co, state, 1);
+#else
+		lua_resetthread(co);
+#endif
+	}
+	if (status != LUA_ERRMEM && lua_type(state, -1) == LUA_TSTRING) {
+		// Add the position of the call.
+		luaL_where(state, 1);
+		lua_insert(state, -2);
+		lua_concat(state, 2);
+	}
+	return lua_error(state);
+} // }}}
+// }}}
+
+int Lua::panic(lua_State *state) { // {{{
+	// An error outside of a protected call; Lua aborts after this returns.
+	char const *msg = lua_tostring(state, -1);
+	std::fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", msg ? msg : "error object is not a string");
+	return 0;
+} // }}}
+// }}}
+
+// class Lua __new__ function.
+PyObject *Lua::create(PyTypeObject *type, PyObject *args, PyObject *kwds) { // {{{
+	int debug = false;
+	int loadlib = false;
+	int searchers = false;
+	int doloadfile = false;
+	int io = false;
+	int os = false;
+	int python_module = true;
+	Py_ssize_t chunk_cache_size = 64;
+	char const *bytecode_cache = nullptr;
+	int slab_allocator = false;
+	Py_ssize_t memory_limit = 0;
+	int hook_interval = 1000;
+	int count_instructions = false;
+	Py_ssize_t freelist_size = 256;
+	char const *keywordnames[] = {"debug", "loadlib", "searchers", "doloadfile", "io", "os", "python_module", "chunk_cache_size", "bytecode_cache", "slab_allocator", "memory_limit", "hook_interval", "count_instructions", "freelist_size", nullptr};
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|pppppppnzpnipn", const_cast <char **>(keywordnames), &debug, &loadlib, &searchers, &doloadfile, &io, &os, &python_module, &chunk_cache_size, &bytecode_cache, &slab_allocator, &memory_limit, &hook_interval, &count_instructions, &freelist_size))
+		return nullptr;
+	if (hook_interval < 1) {
+		PyErr_SetString(PyExc_ValueError, "hook_interval must be at least 1");
+		return nullptr;
+	}
+	if (chunk_cache_size < 0) {
+		PyErr_SetString(PyExc_ValueError, "chunk_cache_size must not be negative");
+		return nullptr;
+	}
+	if (memory_limit < 0) {
+		PyErr_SetString(PyExc_ValueError, "memory_limit must not be negative");
+		return nullptr;
+	}
+	if (freelist_size < 0) {
+		PyErr_SetString(PyExc_ValueError, "freelist_size must not be negative");
+		return nullptr;
+	}
+	Lua *self = reinterpret_cast <Lua *>(type->tp_alloc(type, 0));
+	if (!self)
+		return nullptr;
+	// The object header has been initialized by tp_alloc; the constructor sets up the rest.
+	new (self) Lua(module_state(type), debug, loadlib, searchers, doloadfile, io, os, python_module, chunk_cache_size, bytecode_cache, slab_allocator, memory_limit, hook_interval, count_instructions, freelist_size);
+	return reinterpret_cast <PyObject *>(self);
+} // }}}
+
+// Destructor.
+void Lua::dealloc(Lua *self) { // {{{
+	lua_close(self->state);
+	for (auto name: self->method_names)
+		Py_DECREF(name.second);
+	for (auto metatable: self->metatables)
+		Py_DECREF(metatable.first);
+	self->~Lua();
+	PyTypeObject *type = Py_TYPE(self);
+	type->tp_free(reinterpret_cast <PyObject *>(self));
+	Py_DECREF(type);
+} // }}}
+
+// set variable in Lua.
+void Lua::set(std::string const &name, PyObject *value) { // {{{
+	lua_rawgeti(state, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+	push(value);
+	lua_setfield(state, -2, name.c_str());
+	lua_settop(state, -2);
+} // }}}
+
+// run code after having loaded the buffer (internal use only).
+PyObject *Lua::run_code(int pos, bool keep_single) { // {{{
+	if (!call(0, LUA_MULTRET))
+		return nullptr;
+	return return_values(pos, keep_single);
+} // }}}
+
+// Convert return values above pos on the stack into a Python value and pop them.
+// Without keep_single, a single value is returned as itself and no values as None; otherwise a tuple is returned.
+PyObject *Lua::return_values(int pos, bool keep_single) { // {{{
+	int size = lua_gettop(state) - pos;
+	PyObject *ret;
+	if (keep_single || size > 1) {
+		ret = PyTuple_New(size);
+		for (int i = 0; i < size; ++i) {
+			PyObject *value = to_python(-size + i);	// New reference.
+			PyTuple_SET_ITEM(ret, i, value);	// Steal reference.
+		}
+	}
+	else if (size == 1)
+		ret = to_python(-1);
+	else
+		ret = Py_NewRef(Py_None);
+	lua_settop(state, pos);
+	return ret;
+} // }}}
+
+// run string in lua.
+PyObject *Lua::run(std::string_view cmd, std::string const &description, bool keep_single) { // {{{
+	int pos = lua_gettop(state);
+	int status = load_chunk(cmd, description);
+	if (status != LUA_OK) {
+		error_to_python(status);
+		lua_settop(state, pos);
+		return nullptr;
+	}
+	return run_code(pos, keep_single);
+} // }}}
+
+// Push compiled chunk for a string on the stack, from the cache if possible.
+int Lua::load_chunk(std::string_view cmd, std::string const &description) { // {{{
+	if (chunk_cache_size == 0 || cmd.size() > max_cached_source)
+		return luaL_loadbufferx(state, cmd.data(), cmd.size(), description.c_str(), nullptr);
+
+	// Only the part up to the first NUL is used as chunk name.
+	std::string_view name(description.c_str());
+	auto cached = chunk_index.find(ChunkKey {name, cmd});
+	if (cached != chunk_index.end()) {
+		++chunk_hits;
+		chunks.splice(chunks.begin(), chunks, cached->second);
+		lua_rawgeti(state, LUA_REGISTRYINDEX, cached->second->ref);
+		// The chunk may have replaced its _ENV upvalue last time it ran; reset it like a fresh load would.
+		// A chunk without upvalues (such as a dumped function that uses no globals) does not take the value.
+		lua_rawgeti(state, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+		if (!lua_setupvalue(state, -2, 1))
+			lua_pop(state, 1);
+		return LUA_OK;
+	}
+
+	++chunk_misses;
+	int status = luaL_loadbufferx(state, cmd.data(), cmd.size(), description.c_str(), nullptr);
+	if (status != LUA_OK)
+		return status;
+	if (Py_ssize_t(chunks.size()) >= chunk_cache_size) {
+		++chunk_evictions;
+		Chunk const &old = chunks.back();
+		unref(old.ref);
+		chunk_index.erase(ChunkKey {old.name, old.source});
+		chunks.pop_back();
+	}
+	lua_pushvalue(state, -1);
+	chunks.push_front(Chunk {std::string(name), std::string(cmd), ref()});
+	chunk_index[ChunkKey {chunks.front().name, chunks.front().source}] = chunks.begin();
+	return LUA_OK;
+} // }}}
+
+// Push compiled chunk for a file on the stack, from the bytecode cache if possible.
+int Lua::load_file(std::string const &filename) { // {{{
+	struct stat source;
+	if (bytecode_cache.empty() || stat(filename.c_str(), &source) != 0)
+		return load_source(filename);
+
+	// Lua does not verify bytecode, so anyone who can write to the cache can run code in this process. {{{
+	// The directory is created private, and it and its files are only used if nobody else can have written them.
+	auto trusted = [](struct stat const &info) {
+		return info.st_uid == geteuid() && (info.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+	};
+	mkdir(bytecode_cache.c_str(), 0700);	// Failure (usually because it exists) is handled by the check below.
+	struct stat directory;
+	if (stat(bytecode_cache.c_str(), &directory) != 0 || !S_ISDIR(directory.st_mode) || !trusted(directory))
+		return load_source(filename);
+	// }}}
+
+	// Cache files are named after the full path of the source. {{{
+	char *real = realpath(filename.c_str(), nullptr);
+	std::string path = real ? real : filename;
+	std::free(real);
+	std::string cachename = bytecode_cache + "/" + std::to_string(std::hash <std::string>()(path)) + ".luac";
+	// }}}
+
+	// The header identifies what the bytecode was compiled from.
+	// It is followed by a line with the size and checksum of the bytecode, and the bytecode itself.
+	std::string header = std::string("python-lua bytecode\n" LUA_RELEASE "\n") + path + "\n"
+		+ std::to_string(source.st_size) + " " + std::to_string(source.st_mtim.tv_sec) + "." + std::to_string(source.st_mtim.tv_nsec) + "\n";
+	auto checksum = [](char const *data, size_t size) { // {{{ FNV-1a, to detect damaged cache files.
+		unsigned long long hash = 14695981039346656037ull;
+		for (size_t i = 0; i < size; ++i)
+			hash = (hash ^ static_cast <unsigned char>(data[i])) * 1099511628211ull;
+		return hash;
+	}; // }}}
+
+	// Try to use the cache file. Anything unexpected means it is stale or corrupt, and the source is loaded instead. {{{
+	std::string cached;
+	FILE *f = std::fopen(cachename.c_str(), "rb");
+	struct stat info;
+	if (f && (fstat(fileno(f), &info) != 0 || !S_ISREG(info.st_mode) || !trusted(info))) {
+		std::fclose(f);
+		f = nullptr;
+	}
+	if (f) {
+		char buffer[BUFSIZ];
+		size_t len;
+		while ((len = std::fread(buffer, 1, sizeof(buffer), f)) > 0)
+			cached.append(buffer, len);
+		std::fclose(f);
+	}
+	if (cached.compare(0, header.size(), header) == 0) {
+		size_t start = cached.find('\n', header.size());
+		unsigned long long size, sum;
+		if (start != std::string::npos && std::sscanf(cached.c_str() + header.size(), "%llu %llu\n", &size, &sum) == 2) {
+			char const *code = cached.data() + start + 1;
+			if (size == cached.size() - start - 1 && sum == checksum(code, size)) {
+				if (luaL_loadbufferx(state, code, size, ("@" + filename).c_str(), "b") == LUA_OK)
+					return LUA_OK;
+				lua_pop(state, 1);
+			}
+		}
+	}
+	// }}}
+
+	int status = load_source(filename);
+	if (status != LUA_OK)
+		return status;
+
+	// Write new cache file. It is written to a temporary file first, so other processes never see a partial file. {{{
+	std::string code;
+	if (lua_dump(state, dump_writer, &code, false) != 0)
+		return LUA_OK;
+	std::string data = header + std::to_string(code.size()) + " " + std::to_string(checksum(code.data(), code.size())) + "\n" + code;
+	std::string tempname = cachename + ".XXXXXX";
+	int fd = mkstemp(tempname.data());
+	if (fd < 0)
+		return LUA_OK;	// The cache is best effort; failing to write it is not an error.
+	size_t done = 0;
+	while (done < data.size()) {
+		ssize_t len = write(fd, data.data() + done, data.size() - done);
+		if (len <= 0)
+			break;
+		done += len;
+	}
+	if (close(fd) != 0 || done < data.size() || std::rename(tempname.c_str(), cachename.c_str()) != 0)
+		unlink(tempname.c_str());
+	// }}}
+	return LUA_OK;
+} // }}}
+
+// Push compiled chunk for a source file on the stack; large files are mapped instead of read.
+int Lua::load_source(std::string const &filename) { // {{{
+	int fd = open(filename.c_str(), O_RDONLY);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size < mmap_threshold) {
+		// Small or special files are read by Lua; this also lets it report errors.
+		if (fd >= 0)
+			close(fd);
+		return luaL_loadfilex(state, filename.c_str(), nullptr);
+	}
+	void *map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return luaL_loadfilex(state, filename.c_str(), nullptr);
+	madvise(map, info.st_size, MADV_SEQUENTIAL);
+
+	// Skip a byte order mark and an initial # line, like luaL_loadfilex does. The newline is kept, so line numbers are right,
+	// unless precompiled code follows it: that must start at the signature.
+	std::string_view code(reinterpret_cast <char const *>(map), info.st_size);
+	if (code.starts_with("\xEF\xBB\xBF"))
+		code.remove_prefix(3);
+	if (code.starts_with('#')) {
+		code.remove_prefix(std::min(code.find('\n'), code.size()));
+		if (code.size() > 1 && code[1] == LUA_SIGNATURE[0])
+			code.remove_prefix(1);
+	}
+
+	int status = luaL_loadbufferx(state, code.data(), code.size(), ("@" + filename).c_str(), nullptr);
+	munmap(map, info.st_size);
+	return status;
+} // }}}
+
+// lua_Writer that appends to a std::string.
+int Lua::dump_writer(lua_State *, void const *data, size_t size, void *target) { // {{{
+	reinterpret_cast <std::string *>(target)->append(reinterpret_cast <char const *>(data), size);
+	return 0;
+} // }}}
+
+// Run code that is read from a Python file-like object or iterator in Lua. {{{
+struct Lua::StreamReader {
+	PyObject *read;	// Bound read method of a file-like object, or nullptr.
+	PyObject *iter;	// Iterator, if read is nullptr.
+	PyObject *part;	// The part of the code that Lua is currently reading.
+	Py_buffer view;
+	bool failed;	// Set when a Python exception is pending.
+};
+
+char const *Lua::stream_reader(lua_State *, void *data, size_t *size) { // {{{
+	StreamReader *reader = reinterpret_cast <StreamReader *>(data);
+	// Lua is done with the previous part when it asks for the next one.
+	if (reader->part) {
+		if (reader->view.obj)
+			PyBuffer_Release(&reader->view);
+		Py_CLEAR(reader->part);
+	}
+	*size = 0;
+	if (reader->failed)
+		return nullptr;
+	if (reader->read)
+		reader->part = PyObject_CallFunction(reader->read, "n", Py_ssize_t(65536));
+	else
+		reader->part = PyIter_Next(reader->iter);
+	if (!reader->part) {
+		reader->failed = PyErr_Occurred() != nullptr;
+		return nullptr;
+	}
+	if (PyUnicode_Check(reader->part)) {
+		Py_ssize_t len;
+		char const *text = PyUnicode_AsUTF8AndSize(reader->part, &len);
+		if (!text) {
+			reader->failed = true;
+			return nullptr;
+		}
+		*size = len;
+		return text;
+	}
+	if (PyObject_GetBuffer(reader->part, &reader->view, PyBUF_SIMPLE) < 0) {
+		reader->view.obj = nullptr;
+		reader->failed = true;
+		return nullptr;
+	}
+	*size = reader->view.len;
+	return reinterpret_cast <char const *>(reader->view.buf);
+} // }}}
+
+PyObject *Lua::run_stream(PyObject *source, std::string const &description, bool keep_single) { // {{{
+	StreamReader reader {nullptr, nullptr, nullptr, {}, false};
+	if (PyObject_HasAttrString(source, "read"))
+		reader.read = PyObject_GetAttrString(source, "read");	// New reference.
+	else
+		reader.iter = PyObject_GetIter(source);	// New reference.
+	if (!reader.read && !reader.iter)
+		return nullptr;
+	int pos = lua_gettop(state);
+	int status = lua_load(state, stream_reader, &reader, description.c_str(), nullptr);
+	if (reader.part) {
+		if (reader.view.obj)
+			PyBuffer_Release(&reader.view);
+		Py_DECREF(reader.part);
+	}
+	Py_XDECREF(reader.read);
+	Py_XDECREF(reader.iter);
+	if (reader.failed) {
+		lua_settop(state, pos);
+		return nullptr;
+	}
+	if (status != LUA_OK) {
+		error_to_python(status);
+		lua_settop(state, pos);
+		return nullptr;
+	}
+	return run_code(pos, keep_single);
+} // }}}
+// }}}
+
+// run file in lua.
+PyObject *Lua::run_file(std::string const &filename, [[maybe_unused]] std::string const &description, bool keep_single) { // {{{
+	int pos = lua_gettop(state);
+	int status = load_file(filename);
+	if (status != LUA_OK) {
+		error_to_python(status);
+		lua_settop(state, pos);
+		return nullptr;
+	}
+	return run_code(pos, keep_single);
+} // }}}
+
+// load module into lua.
+void Lua::load_module(std::string const &name, PyObject *dict) { // {{{
+	if (!PyDict_Check(dict)) {
 		PyObject *new_dict = PyDict_New();	// new reference
 		PyObject *dir = PyObject_Dir(dict);	// new reference
 		Py_ssize_t size = PyList_Size(dir);
@@ -541,6 +2360,7 @@ void Lua::load_module(std::string const &name, PyObject *dict) { // {{{
 // load variable from lua stack into python.
 PyObject *Lua::to_python(int index) { // {{{
 	int type = lua_type(state, index);
+	stats.to_python(type);
 	switch(type) {
 	case LUA_TNIL:
 		Py_RETURN_NONE;
@@ -572,7 +2392,7 @@ PyObject *Lua::to_python(int index) { // {{{
 	case LUA_TUSERDATA:
 		// This is a Python-owned object that was used by Lua.
 		// The data block of the userdata stores the PyObject *.
-		return *reinterpret_cast <PyObject **>(lua_touserdata(state, index));
+		return Py_NewRef(*reinterpret_cast <PyObject **>(lua_touserdata(state, index)));
 	//case LUA_TTHREAD: // Not used.
 	//	return lua_tothread(state, index)
 	default:
@@ -585,30 +2405,44 @@ PyObject *Lua::to_python(int index) { // {{{
 
 // load variable from python onto lua stack.
 void Lua::push(PyObject *obj) { // {{{
-	if (obj == Py_None)
+	if (obj == Py_None) {
+		stats.push(Stats::PUSH_NONE);
 		lua_pushnil(state);
-	else if (PyBool_Check(obj))
+	}
+	else if (PyBool_Check(obj)) {
+		stats.push(Stats::PUSH_BOOL);
 		lua_pushboolean(state, obj == Py_True);
-	else if (PyLong_Check(obj))
+	}
+	else if (PyLong_Check(obj)) {
+		stats.push(Stats::PUSH_INT);
 		lua_pushinteger(state, PyLong_AsLongLong(obj));
+	}
 	else if (PyUnicode_Check(obj)) {
 		// A str is encoded as bytes in Lua; bytes is wrapped as an object.
+		stats.push(Stats::PUSH_STR);
 		Py_ssize_t len;
 		char const *str = PyUnicode_AsUTF8AndSize(obj, &len);
 		lua_pushlstring(state, str, len);
 	}
-	else if (PyFloat_Check(obj))
+	else if (PyFloat_Check(obj)) {
+		stats.push(Stats::PUSH_FLOAT);
 		lua_pushnumber(state, PyFloat_AsDouble(obj));
-	else if (PyObject_TypeCheck(obj, &TableType))
+	}
+	else if (PyObject_TypeCheck(obj, types->TableType)) {
+		stats.push(Stats::PUSH_TABLE);
 		lua_rawgeti(state, LUA_REGISTRYINDEX, reinterpret_cast <Table *>(obj)->id);
-	else if (PyObject_TypeCheck(obj, &FunctionType))
+	}
+	else if (PyObject_TypeCheck(obj, types->FunctionType)) {
+		stats.push(Stats::PUSH_FUNCTION);
 		lua_rawgeti(state, LUA_REGISTRYINDEX, reinterpret_cast <Function *>(obj)->id);
+	}
 	else {
+		stats.push(Stats::PUSH_OBJECT);
 		*reinterpret_cast <PyObject **>(lua_newuserdatauv(state, sizeof(PyObject *), 0)) = obj;
 		Py_INCREF(obj);
 		// FIXME: use gc metamethod to DECREF the object.
 		
-		lua_getfield(state, LUA_REGISTRYINDEX, "metatable");
+		push_metatable(Py_TYPE(obj));
 		lua_setmetatable(state, -2);
 	}
 } // }}}
@@ -641,57 +2475,156 @@ void Lua::push_luatable(PyObject *obj) { // {{{
 	}
 } // }}}
 
+// Push metatable for userdata objects of the given Python type, creating it if needed.
+void Lua::push_metatable(PyTypeObject *type) { // {{{
+	auto cached = metatables.find(type);
+	if (cached != metatables.end()) {
+		lua_rawgeti(state, LUA_REGISTRYINDEX, cached->second);
+		return;
+	}
+
+	lua_createtable(state, 0, lua2python.size() + 2);
+
+	// Generic metamethods, which look up the Python method by name.
+	for (auto op: lua2python) {
+		lua_pushlightuserdata(state, method_names[op.first]);
+		lua_pushcclosure(state, metamethod, 1);
+		lua_setfield(state, -2, op.first);
+	}
+
+	// Replace them with direct slot calls where the type has the slot. {{{
+	if (type->tp_as_number) {
+		char *number = reinterpret_cast <char *>(type->tp_as_number);
+		for (auto const *op = binary_slots; op->lua_name; ++op) {
+			void *slot = *reinterpret_cast <void **>(number + op->offset);
+			if (!slot)
+				continue;
+			lua_pushlightuserdata(state, slot);
+			lua_pushlightuserdata(state, op->fallback);
+			lua_pushcclosure(state, binary_slot, 2);
+			lua_setfield(state, -2, op->lua_name);
+		}
+		for (auto const *op = unary_slots; op->lua_name; ++op) {
+			void *slot = *reinterpret_cast <void **>(number + op->offset);
+			if (!slot)
+				continue;
+			lua_pushlightuserdata(state, slot);
+			lua_pushcclosure(state, unary_slot, 1);
+			lua_setfield(state, -2, op->lua_name);
+		}
+		if (type->tp_as_number->nb_power) {
+			lua_pushlightuserdata(state, reinterpret_cast <void *>(type->tp_as_number->nb_power));
+			lua_pushcclosure(state, power_slot, 1);
+			lua_setfield(state, -2, "__pow");
+		}
+	}
+	lenfunc length = nullptr;
+	if (type->tp_as_sequence && type->tp_as_sequence->sq_length)
+		length = type->tp_as_sequence->sq_length;
+	else if (type->tp_as_mapping && type->tp_as_mapping->mp_length)
+		length = type->tp_as_mapping->mp_length;
+	if (length) {
+		lua_pushlightuserdata(state, reinterpret_cast <void *>(length));
+		lua_pushcclosure(state, length_slot, 1);
+		lua_setfield(state, -2, "__len");
+	}
+	if (type->tp_as_mapping && type->tp_as_mapping->mp_subscript) {
+		lua_pushlightuserdata(state, reinterpret_cast <void *>(type->tp_as_mapping->mp_subscript));
+		lua_pushlightuserdata(state, reinterpret_cast <void *>(PyObject_GetItem));
+		lua_pushcclosure(state, binary_slot, 2);
+		lua_setfield(state, -2, "__index");
+	}
+	if (type->tp_as_mapping && type->tp_as_mapping->mp_ass_subscript) {
+		lua_pushlightuserdata(state, reinterpret_cast <void *>(type->tp_as_mapping->mp_ass_subscript));
+		lua_pushcclosure(state, setitem_slot, 1);
+		lua_setfield(state, -2, "__newindex");
+	}
+	if (type->tp_richcompare) {
+		std::pair <char const *, int> const compares[] = {{"__eq", Py_EQ}, {"__lt", Py_LT}, {"__le", Py_LE}};
+		for (auto compare: compares) {
+			lua_pushlightuserdata(state, type);
+			lua_pushinteger(state, compare.second);
+			lua_pushcclosure(state, compare_slot, 2);
+			lua_setfield(state, -2, compare.first);
+		}
+	}
+	if (type->tp_repr) {
+		lua_pushlightuserdata(state, reinterpret_cast <void *>(type->tp_repr));
+		lua_pushcclosure(state, unary_slot, 1);
+		lua_setfield(state, -2, "__tostring");
+	}
+	// }}}
+
+	// Calls don't need a method lookup; call the object directly (through vectorcall if the type supports it).
+	lua_pushlightuserdata(state, nullptr);
+	lua_pushcclosure(state, metamethod, 1);
+	lua_setfield(state, -2, "__call");
+
+	// Set gc metamethod. This is not passed through to Python, but instead cleans up the PyObject * reference.
+	lua_pushcclosure(state, gc, 0);
+	lua_setfield(state, -2, "__gc");
+
+	// Store the metatable, keeping the type alive so its address is not reused while it is in the map.
+	lua_pushvalue(state, -1);
+	metatables[type] = ref();
+	Py_INCREF(type);
+} // }}}
+
 // Constructor.
-Lua::Lua(bool debug, bool loadlib, bool searchers, bool doloadfile, bool io, bool os, bool python_module) { // {{{
+Lua::Lua(ModuleState *types, bool debug, bool loadlib, bool searchers, bool doloadfile, bool io, bool os, bool python_module, Py_ssize_t chunk_cache_size, char const *bytecode_cache, bool slab_allocator, Py_ssize_t memory_limit, int hook_interval, bool count_instructions, Py_ssize_t freelist_size) :
+		types(types),
+		allocator(slab_allocator),
+		table_freelist(freelist_size),
+		function_freelist(freelist_size),
+		chunk_cache_size(0),	// Setup code is not cached; the cache is enabled at the end of the constructor.
+		chunk_hits(0),
+		chunk_misses(0),
+		chunk_evictions(0),
+		bytecode_cache(bytecode_cache ? bytecode_cache : ""),
+		hook_interval(hook_interval),
+		count_instructions(count_instructions),
+		call_depth(0),
+		counting(false),
+		instructions(0),
+		max_instructions(0),
+		limit_hit(nullptr),
+		running(0),
+		cancel_requested(false),
+		current(nullptr),
+		profile_interval(0),
+		hook_count(0),
+		since_sample(0),
+		released(nullptr) { // {{{
 	// Create a new lua object.
 	// This object provides the interface into the lua library.
 	// It also provides access to all the symbols that lua owns.
 
 	// Create new state and store back pointer to self.
-	state = luaL_newstate();
-	lua_pushlightuserdata(state, this);
-	lua_setfield(state, LUA_REGISTRYINDEX, "self");
+	// It is stored in the extra space of the main thread, which Lua copies into every new thread.
+	state = lua_newstate(Allocator::alloc, &allocator);
+	lua_atpanic(state, panic);
+	*reinterpret_cast <Lua **>(lua_getextraspace(state)) = this;
+	current = state;
 
 	// Open standard libraries. Many of them are closed again below.
 	luaL_openlibs(state);
 
-	// Store operators, because the API does not define them. {{{
-	// Binary operators.
-	for (auto pair: opnames) {
-		char const * const &op = pair.first;
-		char const * const &name = pair.second;
-		ops[name] = run(std::string("return function(a, b) return a ") + op + " b end", std::string("get ") + name, false);
-	}
-
-	// Unary operators.
-	ops["neg"] = run("return function(a) return -a end", std::string("get neg"), false);
-	ops["invert"] = run("return function(a) return ~a end", std::string("get invert"), false);
-	ops["repr"] = run("return function(a) return tostring(a) end", std::string("get repr"), false);
-	// Skipped: len, getitem, setitem, delitem, because they have API calls which are used.
-	// }}}
-
 	// Store a copy of some initial values, so they still work if the original value is replaced.
 	table_remove = run("return table.remove", "get table.remove", false);
 	package_loaded = run("return package.loaded", "get package.loaded", false);
 	_G = run("return _G", "get _G", false);
 
-	// Set up metatable for userdata objects. {{{
-	lua_createtable(state, 0, lua2python.size() + 1);
-	for (auto op: lua2python) {
-		// Set upvalue to python method name.
-		lua_pushstring(state, op.second);
-
-		// Create metatable function.
-		lua_pushcclosure(state, metamethod, 1);
-		lua_setfield(state, -2, op.first);
-	}
-	// Set gc metamethod. This is not passed through to Python, but instead cleans up the PyObject * reference.
-	lua_pushcclosure(state, gc, 0);
-	lua_setfield(state, -2, "__gc");
+	// Resume coroutines through resume_thread(), so limits and cancel() reach them.
+	lua_getglobal(state, "coroutine");
+	lua_pushcfunction(state, coroutine_resume);
+	lua_setfield(state, -2, "resume");
+	lua_pushcfunction(state, coroutine_wrap);
+	lua_setfield(state, -2, "wrap");
+	lua_pop(state, 1);
 
-	// Set the metatable in the registry, for use by new userdata objects.
-	lua_setfield(state, LUA_REGISTRYINDEX, "metatable");
-	// }}}
+	// Prepare method names for userdata metatables. The metatables themselves are created per type by push_metatable().
+	for (auto op: lua2python)
+		method_names[op.first] = PyUnicode_InternFromString(op.second);
 
 	// Disable optional features that have not been requested. {{{
 	if (!debug)
@@ -708,378 +2641,961 @@ Lua::Lua(bool debug, bool loadlib, bool searchers, bool doloadfile, bool io, boo
 		run("io = nil package.loaded.io = nil", "disabling io", false);
 	// }}}
 
-	/* Add access to Python object constructors from Lua (unless disabled).
-	   TODO when Table interface has been implemented.
+	// Add access to Python object constructors from Lua (unless disabled).
 	if (python_module) {
-# Lua module for accessing some Python parts from Lua. This is prepared as a "python" module unless disabled. {{{
-def construct_bytes(arg):
-	'Implementation of python.bytes()'
-	if isinstance(arg, Table):
-		return bytes(arg.list())
-	if isinstance(arg, str):
-		return arg.encode('utf-8')
-	return bytes(arg)
-
-python = {
-	'list': lambda table: table.list(),
-	'dict': lambda table: table.dict(),
-	'bytes': construct_bytes
-}
-# }}}
+		PyObject *module = PyDict_New();	// New reference.
+		for (PyMethodDef *def = python_functions; module && def->ml_name; ++def) {
+			PyObject *function = PyCFunction_New(def, reinterpret_cast <PyObject *>(types->TableType));	// New reference.
+			if (!function || PyDict_SetItemString(module, def->ml_name, function) < 0)
+				Py_CLEAR(module);
+			Py_XDECREF(function);
+		}
+		if (module) {
+			load_module("python", module);
+			Py_DECREF(module);
+		}
+		else
+			PyErr_Clear();	// The constructor cannot fail; Lua code that needs the module gets an error from require().
+	}
 
-		create_lua_module("python", Py_BuildValue("{sO sO sO}",
-					"list", table.list,
-					"dict", table.dict,
-					"bytes", construct_bytes));
-	}*/
+	// Enable the compiled chunk cache for run().
+	this->chunk_cache_size = chunk_cache_size;
+
+	// Limit memory use. Setting up the state is not limited, so that it cannot fail.
+	allocator.limit = memory_limit;
 } // }}}
 // }}}
 
 // class Function implementation. {{{
 // Python-accessible methods.
 PyMethodDef Function::methods[] = { // {{{
-	{"__call__", reinterpret_cast <PyCFunction>(call_method), METH_VARARGS | METH_KEYWORDS, "Call the Lua function"},
+	{"map", reinterpret_cast <PyCFunction>(map_method), METH_VARARGS | METH_KEYWORDS, "Call the Lua function for every item, return list of results"},
+	{"starmap", reinterpret_cast <PyCFunction>(starmap_method), METH_VARARGS | METH_KEYWORDS, "Call the Lua function with every item as arguments, return list of results"},
 	{nullptr, nullptr, 0, nullptr}
 }; // }}}
 
 // __new__ Function.
 PyObject *Function::create(Lua *context) { // {{{
-	Function *self = reinterpret_cast <Function *>(FunctionType.tp_alloc(&FunctionType, 0));
+	Function *self = reinterpret_cast <Function *>(context->function_freelist.alloc(context->types->FunctionType));
 	if (!self)
 		return nullptr;
+	self->vectorcall = reinterpret_cast <vectorcallfunc>(call);
 	self->lua = context;
 	Py_INCREF(self->lua);
-	self->id = luaL_ref(self->lua->state, LUA_REGISTRYINDEX);
+	self->id = self->lua->ref();
 	return reinterpret_cast <PyObject *>(self);
 }; // }}}
 
 // Destructor.
 void Function::dealloc(Function *self) { // {{{
-	luaL_unref(self->lua->state, LUA_REGISTRYINDEX, self->id);
-	Py_DECREF(self->lua);
-	FunctionType.tp_free(reinterpret_cast <PyObject *>(self));
+	Lua *lua = self->lua;
+	PyTypeObject *type = Py_TYPE(self);
+	{
+		// The lock must be released before the Lua object can be destroyed.
+		// After the memory is on the free list, it may be reused by another thread as soon as the lock is released.
+		Lua::Lock lock(lua);
+		lua->unref(self->id);
+		lua->function_freelist.free(reinterpret_cast <PyObject *>(self));
+	}
+	Py_DECREF(lua);
+	Py_DECREF(type);
 } // }}}
 
-PyObject *Function::call_method(Function *self, PyObject *args, PyObject *keywords) { // {{{
+PyObject *Function::call(Function *self, PyObject *const *args, size_t nargsf, PyObject *kwnames) { // {{{
+	Lua::Lock lock(self->lua);
+	Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
 
-	// Parse keep_single argument.
+	// Parse keyword arguments. Keyword values follow the positional arguments in args.
 	bool keep_single = false;
-	PyObject *kw = PyDict_GetItemString(keywords, "keep_single");	// Returns borrowed reference.
-	Py_ssize_t size = PyDict_Size(keywords);
-	if (kw) {
-		if (!PyBool_Check(kw)) {
-			PyErr_SetString(PyExc_ValueError, "keep_single argument must be of bool type");
-			return nullptr;
+	Py_ssize_t max_instructions = 0;
+	double timeout = 0;
+	if (kwnames) {
+		Py_ssize_t nkw = PyTuple_GET_SIZE(kwnames);
+		for (Py_ssize_t k = 0; k < nkw; ++k) {
+			PyObject *name = PyTuple_GET_ITEM(kwnames, k);	// Borrowed reference.
+			PyObject *kw = args[nargs + k];	// Borrowed reference.
+			if (PyUnicode_CompareWithASCIIString(name, "keep_single") == 0) {
+				if (!PyBool_Check(kw)) {
+					PyErr_SetString(PyExc_ValueError, "keep_single argument must be of bool type");
+					return nullptr;
+				}
+				keep_single = kw == Py_True;
+			}
+			else if (PyUnicode_CompareWithASCIIString(name, "max_instructions") == 0) {
+				max_instructions = PyLong_AsSsize_t(kw);
+				if (max_instructions == -1 && PyErr_Occurred())
+					return nullptr;
+			}
+			else if (PyUnicode_CompareWithASCIIString(name, "timeout") == 0) {
+				timeout = PyFloat_AsDouble(kw);
+				if (timeout == -1 && PyErr_Occurred())
+					return nullptr;
+			}
+			else {
+				PyErr_SetString(PyExc_ValueError, "only keep_single, max_instructions and timeout are supported as keyword arguments");
+				return nullptr;
+			}
 		}
-		keep_single = kw == Py_True;
-		size -= 1;
-	}
-	if (size > 0) {
-		PyErr_SetString(PyExc_ValueError, "only keep_single is supported as a keyword argument");
-		return nullptr;
 	}
+	Lua::Limits limits(self->lua, max_instructions, timeout);
 
 	// Push target function to stack.
-	int pos = lua_gettop(self->lua->state);
-	lua_rawgeti(self->lua->state, LUA_REGISTRYINDEX, self->id);
+	lua_State *state = self->lua->state;
+	int pos = lua_gettop(state);
+	lua_rawgeti(state, LUA_REGISTRYINDEX, self->id);
+
+	// Push arguments to stack, straight from the argument vector.
+	for (Py_ssize_t a = 0; a < nargs; ++a)
+		self->lua->push(args[a]);	// Borrowed reference.
+	if (!self->lua->call(nargs, LUA_MULTRET))
+		return nullptr;
+	return self->lua->return_values(pos, keep_single);
+} // }}}
+
+// Call the function once for every item of iterable, collecting the results in a list.
+PyObject *Function::map(PyObject *iterable, PyObject *out, bool star) { // {{{
+	PyObject *iter = PyObject_GetIter(iterable);	// New reference.
+	if (!iter)
+		return nullptr;
+
+	// Collect the results in out, overwriting its items, or in a new list, which is presized if the length is known.
+	PyObject *ret;
+	if (out)
+		ret = Py_NewRef(out);
+	else {
+		Py_ssize_t hint = PyObject_LengthHint(iterable, 0);
+		ret = hint < 0 ? nullptr : PyList_New(hint);
+	}
+	if (!ret) {
+		Py_DECREF(iter);
+		return nullptr;
+	}
 
-	// Push arguments to stack.
-	assert(PyList_Check(args));
-	Py_ssize_t nargs = PyList_Size(args);
-	for (Py_ssize_t a = 0; a < nargs; ++a) {
-		PyObject *arg = PyList_GetItem(args, a);	// Borrowed reference.
-		self->lua->push(arg);
-	}
-	lua_call(self->lua->state, nargs, LUA_MULTRET);
-	size = lua_gettop(self->lua->state) - pos;
-	if (!keep_single && size < 2) {
-		if (size == 0)
-			Py_RETURN_NONE;
-		// Size is 1.
-		return self->lua->to_python(-1);
-	}
-	PyObject *ret = PyTuple_New(size);
-	for (int i = 0; i < size; ++i) {
-		PyObject *value = self->lua->to_python(-size + i);	// New reference.
-		PyTuple_SET_ITEM(ret, i, value);	// Steal reference.
-	}
-	lua_settop(self->lua->state, pos);
+	// Keep the function on the stack, and push a copy of it for every call.
+	lua_State *state = lua->state;
+	int pos = lua_gettop(state);
+	lua_rawgeti(state, LUA_REGISTRYINDEX, id);
+	Py_ssize_t n = 0;
+	PyObject *item;
+	while ((item = PyIter_Next(iter))) {	// New reference.
+		lua_pushvalue(state, pos + 1);
+		Py_ssize_t nargs = 1;
+		if (star) {
+			PyObject *args = PySequence_Fast(item, "starmap arguments must be sequences");	// New reference.
+			Py_DECREF(item);
+			if (!args)
+				break;
+			nargs = PySequence_Fast_GET_SIZE(args);
+			PyObject **items = PySequence_Fast_ITEMS(args);
+			for (Py_ssize_t a = 0; a < nargs; ++a)
+				lua->push(items[a]);	// Borrowed reference.
+			Py_DECREF(args);
+		}
+		else {
+			lua->push(item);
+			Py_DECREF(item);
+		}
+		PyObject *value = lua->call(nargs, LUA_MULTRET) ? lua->return_values(pos + 1, false) : nullptr;	// New reference.
+		if (!value)
+			break;
+		if (n < PyList_GET_SIZE(ret)) {
+			// The old item (if any) is released after the list is consistent again, because that can run Python code.
+			PyObject *old = PyList_GET_ITEM(ret, n);
+			PyList_SET_ITEM(ret, n, value);	// Steals reference.
+			Py_XDECREF(old);
+		}
+		else {
+			int result = PyList_Append(ret, value);
+			Py_DECREF(value);
+			if (result < 0)
+				break;
+		}
+		++n;
+	}
+	lua_settop(state, pos);
+	Py_DECREF(iter);
+	bool failed = PyErr_Occurred();
+	if (failed && !out) {
+		Py_DECREF(ret);
+		return nullptr;
+	}
+	// Remove unused items, if the length hint was too large or out was longer. After an error,
+	// out keeps the results of the calls that succeeded.
+	if (n < PyList_GET_SIZE(ret)) {
+		PyObject *type, *value, *traceback;
+		PyErr_Fetch(&type, &value, &traceback);
+		if (PyList_SetSlice(ret, n, PyList_GET_SIZE(ret), nullptr) < 0) {
+			Py_XDECREF(type);
+			Py_XDECREF(value);
+			Py_XDECREF(traceback);
+			failed = true;
+		}
+		else
+			PyErr_Restore(type, value, traceback);
+	}
+	if (failed) {
+		Py_DECREF(ret);
+		return nullptr;
+	}
 	return ret;
 } // }}}
+
+PyObject *Function::map_method(Function *self, PyObject *args, PyObject *keywords) { // {{{
+	Lua::Lock lock(self->lua);
+	PyObject *iterable;
+	PyObject *out = nullptr;
+	char const *keywordnames[] = {"iterable", "out", nullptr};
+	if (!PyArg_ParseTupleAndKeywords(args, keywords, "O|O!", const_cast <char **>(keywordnames), &iterable, &PyList_Type, &out))
+		return nullptr;
+	return self->map(iterable, out, false);
+} // }}}
+
+PyObject *Function::starmap_method(Function *self, PyObject *args, PyObject *keywords) { // {{{
+	Lua::Lock lock(self->lua);
+	PyObject *iterable;
+	PyObject *out = nullptr;
+	char const *keywordnames[] = {"iterable", "out", nullptr};
+	if (!PyArg_ParseTupleAndKeywords(args, keywords, "O|O!", const_cast <char **>(keywordnames), &iterable, &PyList_Type, &out))
+		return nullptr;
+	return self->map(iterable, out, true);
+} // }}}
 // }}}
 
 // class Table implementation. {{{
 // Python-accessible methods.
 PyMethodDef Table::methods[] = { // {{{
-	{"__len__", reinterpret_cast <PyCFunction>(len_method), METH_VARARGS, "Call the # operator on the Lua table"},
-	{"__iadd__", reinterpret_cast <PyCFunction>(iadd_method), METH_VARARGS, "Call the += operator on the Lua table"},
-	{"__getitem__", reinterpret_cast <PyCFunction>(getitem_method), METH_VARARGS, "Get item from Lua table"},
-	{"__setitem__", reinterpret_cast <PyCFunction>(setitem_method), METH_VARARGS, "Set item in Lua table"},
-	{"__delitem__", reinterpret_cast <PyCFunction>(delitem_method), METH_VARARGS, "Remove item from Lua table"},
-	{"__contains__", reinterpret_cast <PyCFunction>(contains_method), METH_VARARGS, "Check if Lua table contains item"},
-	{"__iter__", reinterpret_cast <PyCFunction>(iter_method), METH_VARARGS, "Loop over the Lua table"},
-	{"__ne__", reinterpret_cast <PyCFunction>(ne_method), METH_VARARGS, "Call the ~= operator on the Lua table"},
-	{"__gt__", reinterpret_cast <PyCFunction>(gt_method), METH_VARARGS, "Call the > operator on the Lua table"},
-	{"__ge__", reinterpret_cast <PyCFunction>(ge_method), METH_VARARGS, "Call the >= operator on the Lua table"},
-	{"dict", reinterpret_cast <PyCFunction>(dict_method), METH_VARARGS, "Create dict from Lua table"},
-	{"list", reinterpret_cast <PyCFunction>(list_method), METH_VARARGS, "Create list from Lua table"},
+	{"dict", reinterpret_cast <PyCFunction>(dict_method), METH_NOARGS, "Create dict from Lua table"},
+	{"list", reinterpret_cast <PyCFunction>(list_method), METH_VARARGS | METH_KEYWORDS, "Create list from (part of) the sequence in the Lua table"},
 	{"pop", reinterpret_cast <PyCFunction>(pop_method), METH_VARARGS, "Remove item from Lua table"},
 	{nullptr, nullptr, 0, nullptr}
 }; // }}}
 
 PyObject *Table::create(Lua *context) { // {{{
-	Table *self = reinterpret_cast <Table *>(TableType.tp_alloc(&TableType, 0));
+	Table *self = reinterpret_cast <Table *>(context->table_freelist.alloc(context->types->TableType));
 	if (!self)
 		return nullptr;
 	self->lua = context;
 	Py_INCREF(self->lua);
-	self->id = luaL_ref(self->lua->state, LUA_REGISTRYINDEX);
-	for (auto p: context->lua2python)
-		PyObject_SetAttrString(reinterpret_cast <PyObject *>(self), p.second, context->ops[p.first]);
+	self->id = self->lua->ref();
 	return reinterpret_cast <PyObject *>(self);
 }; // }}}
 
 // Destructor.
 void Table::dealloc(Table *self) { // {{{
-	luaL_unref(self->lua->state, LUA_REGISTRYINDEX, self->id);
-	Py_DECREF(self->lua);
-	TableType.tp_free(reinterpret_cast <PyObject *>(self));
+	Lua *lua = self->lua;
+	PyTypeObject *type = Py_TYPE(self);
+	{
+		// The lock must be released before the Lua object can be destroyed.
+		// After the memory is on the free list, it may be reused by another thread as soon as the lock is released.
+		Lua::Lock lock(lua);
+		lua->unref(self->id);
+		lua->table_freelist.free(reinterpret_cast <PyObject *>(self));
+	}
+	Py_DECREF(lua);
+	Py_DECREF(type);
 } // }}}
 
-PyObject *Table::iadd_method(Table *self, PyObject *args) { // {{{
-	// TODO
-	Py_RETURN_NONE;
+// Type slots. {{{
+lua_CFunction const Table::operators[NUM_OPERATORS] = {
+	arith <LUA_OPADD>, arith <LUA_OPSUB>, arith <LUA_OPMUL>, arith <LUA_OPMOD>, arith <LUA_OPPOW>,
+	arith <LUA_OPDIV>, arith <LUA_OPIDIV>, arith <LUA_OPBAND>, arith <LUA_OPBOR>, arith <LUA_OPBXOR>,
+	arith <LUA_OPSHL>, arith <LUA_OPSHR>, arith <LUA_OPUNM>, arith <LUA_OPBNOT>,
+	compare <LUA_OPEQ>, compare <LUA_OPLT>, compare <LUA_OPLE>, concat, len
+};
+
+PyObject *Table::operate(Operator op, PyObject *a, PyObject *b) { // {{{
+	Lua *lua = reinterpret_cast <Table *>(check(a) ? a : b)->lua;
+	Lua::Lock lock(lua);
+	lua_pushcfunction(lua->state, operators[op]);
+	lua->push(a);
+	if (b)
+		lua->push(b);
+	if (!lua->call(b ? 2 : 1, 1))
+		return nullptr;
+	PyObject *ret = lua->to_python(-1);
+	lua_pop(lua->state, 1);
+	return ret;
 } // }}}
 
-PyObject *Table::getitem_method(Table *self, PyObject *args) { // {{{
-	// TODO
-	Py_RETURN_NONE;
+PyObject *Table::power(PyObject *a, PyObject *b, PyObject *mod) { // {{{
+	// Lua has no modular exponentiation.
+	if (mod != Py_None)
+		Py_RETURN_NOTIMPLEMENTED;
+	return operate(OP_POW, a, b);
 } // }}}
 
-PyObject *Table::setitem_method(Table *self, PyObject *args) { // {{{
-	// TODO
-	Py_RETURN_NONE;
+PyObject *Table::inplace_add(Table *self, PyObject *other) { // {{{
+	// Append all items from other.
+	PyObject *iterator = PyObject_GetIter(other);
+	if (!iterator)
+		return nullptr;
+	Lua::Lock lock(self->lua);
+	lua_State *state = self->lua->state;
+	lua_rawgeti(state, LUA_REGISTRYINDEX, self->id);
+	lua_Integer length = lua_rawlen(state, -1);
+	PyObject *item;
+	while ((item = PyIter_Next(iterator))) {
+		self->lua->push(item);
+		Py_DECREF(item);
+		lua_rawseti(state, -2, ++length);
+	}
+	lua_pop(state, 1);
+	Py_DECREF(iterator);
+	if (PyErr_Occurred())
+		return nullptr;
+	Py_INCREF(self);
+	return reinterpret_cast <PyObject *>(self);
 } // }}}
 
-PyObject *Table::delitem_method(Table *self, PyObject *args) { // {{{
-	// TODO
-	Py_RETURN_NONE;
+PyObject *Table::richcompare(Table *self, PyObject *other, int op) { // {{{
+	PyObject *me = reinterpret_cast <PyObject *>(self);
+	switch (op) {
+	case Py_EQ:
+		return operate(OP_EQ, me, other);
+	case Py_NE: {
+		PyObject *equal = operate(OP_EQ, me, other);
+		if (!equal)
+			return nullptr;
+		int result = PyObject_IsTrue(equal);
+		Py_DECREF(equal);
+		if (result < 0)
+			return nullptr;
+		return PyBool_FromLong(!result);
+	}
+	case Py_LT:
+		return operate(OP_LT, me, other);
+	case Py_LE:
+		return operate(OP_LE, me, other);
+	// Lua has no > or >=; like Lua itself, swap the operands.
+	case Py_GT:
+		return operate(OP_LT, other, me);
+	case Py_GE:
+		return operate(OP_LE, other, me);
+	default:
+		Py_RETURN_NOTIMPLEMENTED;
+	}
 } // }}}
 
-PyObject *Table::contains_method(Table *self, PyObject *args) { // {{{
-	// TODO
-	Py_RETURN_NONE;
+Py_hash_t Table::hash(Table *self) { // {{{
+	// Tables are identified by their address in Lua, like when they are used as keys in Lua.
+	// That does not match == for a table with __eq, so such tables are unhashable, like Python objects that define
+	// __eq__ but not __hash__.
+	Lua::Lock lock(self->lua);
+	lua_rawgeti(self->lua->state, LUA_REGISTRYINDEX, self->id);
+	if (luaL_getmetafield(self->lua->state, -1, "__eq") != LUA_TNIL) {
+		lua_pop(self->lua->state, 2);
+		PyErr_SetString(PyExc_TypeError, "unhashable Lua table: its metatable has __eq");
+		return -1;
+	}
+	Py_hash_t ret = Py_hash_t(reinterpret_cast <uintptr_t>(lua_topointer(self->lua->state, -1)) >> 4);
+	lua_pop(self->lua->state, 1);
+	return ret == -1 ? -2 : ret;
 } // }}}
 
-PyObject *Table::iter_method(Table *self, PyObject *args) { // {{{
-	// TODO
-	Py_RETURN_NONE;
+bool Table::call_lua(lua_CFunction function, PyObject *arg1, PyObject *arg2, int nresults) { // {{{
+	lua_pushcfunction(lua->state, function);
+	lua_rawgeti(lua->state, LUA_REGISTRYINDEX, id);
+	int nargs = 1;
+	if (arg1) {
+		lua->push(arg1);
+		nargs += 1;
+	}
+	if (arg2) {
+		lua->push(arg2);
+		nargs += 1;
+	}
+	return lua->call(nargs, nresults);
 } // }}}
 
-PyObject *Table::ne_method(Table *self, PyObject *args) { // {{{
-	PyObject *other;
-	if (!PyArg_ParseTuple(args, "O", &other))	// borrowed reference.
-		return nullptr;
-	self->lua->push(self->lua->ops["__eq"]);
-	lua_rawgeti(self->lua->state, LUA_REGISTRYINDEX, self->id);
-	self->lua->push(other);
-	lua_call(self->lua->state, 2, 1);
-	PyObject *inverted = self->lua->to_python(-1);
+Py_ssize_t Table::length(Table *self) { // {{{
+	Lua::Lock lock(self->lua);
+	if (!self->call_lua(operators[OP_LEN], nullptr, nullptr, 1))
+		return -1;
+	int isnum;
+	lua_Integer ret = lua_tointegerx(self->lua->state, -1, &isnum);
 	lua_pop(self->lua->state, 1);
-	PyObject *ret = PyBool_FromLong(PyObject_Not(inverted));
-	Py_DECREF(inverted);
+	if (!isnum) {
+		PyErr_SetString(PyExc_TypeError, "length of Lua table is not an integer");
+		return -1;
+	}
 	return ret;
 } // }}}
 
-PyObject *Table::gt_method(Table *self, PyObject *args) { // {{{
-	PyObject *other;
-	if (!PyArg_ParseTuple(args, "O", &other))	// borrowed reference.
+PyObject *Table::subscript(Table *self, PyObject *key) { // {{{
+	Lua::Lock lock(self->lua);
+	if (!self->call_lua(gettable, key, nullptr, 1))
 		return nullptr;
-	self->lua->push(self->lua->ops["__lt"]);
-	lua_rawgeti(self->lua->state, LUA_REGISTRYINDEX, self->id);
-	self->lua->push(other);
-	lua_call(self->lua->state, 2, 1);
+	if (lua_isnil(self->lua->state, -1)) {
+		lua_pop(self->lua->state, 1);
+		PyErr_Format(PyExc_IndexError, "Key %R does not exist in Lua table", key);
+		return nullptr;
+	}
 	PyObject *ret = self->lua->to_python(-1);
-	lua_settop(self->lua->state, -1);
+	lua_pop(self->lua->state, 1);
+	return ret;
+} // }}}
+
+int Table::ass_subscript(Table *self, PyObject *key, PyObject *value) { // {{{
+	if (!value) {
+		// Deleting an item is setting it to nil, but raise IndexError if it does not exist.
+		PyObject *old = subscript(self, key);
+		if (!old)
+			return -1;
+		Py_DECREF(old);
+	}
+	Lua::Lock lock(self->lua);
+	return self->call_lua(settable, key, value ? value : Py_None, 0) ? 0 : -1;
+} // }}}
+
+int Table::contains(Table *self, PyObject *key) { // {{{
+	Lua::Lock lock(self->lua);
+	lua_State *state = self->lua->state;
+	lua_rawgeti(state, LUA_REGISTRYINDEX, self->id);
+	self->lua->push(key);
+	lua_rawget(state, -2);
+	int ret = !lua_isnil(state, -1);
+	lua_pop(state, 2);
 	return ret;
 } // }}}
 
-PyObject *Table::ge_method(Table *self, PyObject *args) { // {{{
-	PyObject *other;
-	if (!PyArg_ParseTuple(args, "O", &other))	// borrowed reference.
+PyObject *Table::iter(Table *self) { // {{{
+	// Iterate over a copy of the keys, so the table can be changed during the loop.
+	PyObject *keys = PyList_New(0);
+	if (!keys)
 		return nullptr;
-	self->lua->push(self->lua->ops["__le"]);
-	lua_rawgeti(self->lua->state, LUA_REGISTRYINDEX, self->id);
-	self->lua->push(other);
-	lua_call(self->lua->state, 2, 1);
-	PyObject *ret = self->lua->to_python(-1);
-	lua_settop(self->lua->state, -1);
+	{
+		Lua::Lock lock(self->lua);
+		lua_State *state = self->lua->state;
+		lua_rawgeti(state, LUA_REGISTRYINDEX, self->id);
+		lua_pushnil(state);
+		while (lua_next(state, -2) != 0) {
+			PyObject *key = self->lua->to_python(-2);
+			if (!key || PyList_Append(keys, key) < 0) {
+				Py_XDECREF(key);
+				Py_DECREF(keys);
+				lua_pop(state, 3);
+				return nullptr;
+			}
+			Py_DECREF(key);
+			lua_pop(state, 1);
+		}
+		lua_pop(state, 1);
+	}
+	PyObject *ret = PyObject_GetIter(keys);
+	Py_DECREF(keys);
 	return ret;
 } // }}}
+// }}}
 
-PyObject *Table::dict_method(Table *self, PyObject *args) { // {{{
-	// TODO
-	Py_RETURN_NONE;
+PyObject *Table::dict_method(Table *self, PyObject *) { // {{{
+	Lua::Lock lock(self->lua);
+	lua_State *state = self->lua->state;
+	lua_rawgeti(state, LUA_REGISTRYINDEX, self->id);
+
+	// Count the items first, so the dict does not need to grow. This pass does not convert anything, so it is cheap.
+	Py_ssize_t size = 0;
+	lua_pushnil(state);
+	while (lua_next(state, -2) != 0) {
+		++size;
+		lua_pop(state, 1);
+	}
+#if PY_VERSION_HEX < 0x030d0000
+	PyObject *ret = _PyDict_NewPresized(size);
+#else
+	// _PyDict_NewPresized is no longer part of the API.
+	PyObject *ret = PyDict_New();
+#endif
+	if (!ret) {
+		lua_pop(state, 1);
+		return nullptr;
+	}
+
+	lua_pushnil(state);
+	while (lua_next(state, -2) != 0) {
+		PyObject *key = self->lua->to_python(-2);
+		PyObject *value = key ? self->lua->to_python(-1) : nullptr;
+		lua_pop(state, 1);
+		if (!value || PyDict_SetItem(ret, key, value) < 0) {
+			Py_XDECREF(key);
+			Py_XDECREF(value);
+			Py_DECREF(ret);
+			lua_pop(state, 2);
+			return nullptr;
+		}
+		Py_DECREF(key);
+		Py_DECREF(value);
+	}
+	lua_pop(state, 1);
+	return ret;
 } // }}}
 
-PyObject *Table::list_method(Table *self, PyObject *args) { // {{{
-	// TODO
-	Py_RETURN_NONE;
+PyObject *Table::list_method(Table *self, PyObject *args, PyObject *keywords) { // {{{
+	// start and stop are list indices, so they start at 0 and can be negative, like in a slice.
+	Py_ssize_t start = 0;
+	PyObject *stop_obj = Py_None;	// None means the end of the list.
+	char const *keywordnames[] = {"start", "stop", nullptr};
+	if (!PyArg_ParseTupleAndKeywords(args, keywords, "|nO", const_cast <char **>(keywordnames), &start, &stop_obj))
+		return nullptr;
+	Py_ssize_t stop = PY_SSIZE_T_MAX;
+	if (stop_obj != Py_None) {
+		stop = PyNumber_AsSsize_t(stop_obj, nullptr);	// Out of range values are clipped, which is fine for slicing.
+		if (stop == -1 && PyErr_Occurred())
+			return nullptr;
+	}
+	Lua::Lock lock(self->lua);
+	lua_State *state = self->lua->state;
+	lua_rawgeti(state, LUA_REGISTRYINDEX, self->id);
+	Py_ssize_t size = PySlice_AdjustIndices(lua_rawlen(state, -1), &start, &stop, 1);
+	PyObject *ret = PyList_New(size);
+	if (!ret) {
+		lua_pop(state, 1);
+		return nullptr;
+	}
+	for (Py_ssize_t i = 0; i < size; ++i) {
+		lua_rawgeti(state, -1, start + i + 1);
+		PyObject *item = self->lua->to_python(-1);
+		lua_pop(state, 1);
+		if (!item) {
+			Py_DECREF(ret);
+			lua_pop(state, 1);
+			return nullptr;
+		}
+		PyList_SET_ITEM(ret, i, item);
+	}
+	lua_pop(state, 1);
+	return ret;
 } // }}}
 
 PyObject *Table::pop_method(Table *self, PyObject *args) { // {{{
+	Lua::Lock lock(self->lua);
 	Py_ssize_t index = -1;
 	if (!PyArg_ParseTuple(args, "|n", &index))
 		return nullptr;
-	lua_rawgeti(self->lua->state, LUA_REGISTRYINDEX, self->id);
 	if (index < 0) {
-		lua_len(self->lua->state, -1);
-		PyObject *len = self->lua->to_python(-1);
-		index += PyLong_AsSsize_t(len);
-		Py_DECREF(len);
-		lua_pop(self->lua->state, 1);
+		// The length may come from __len, which can raise an error.
+		Py_ssize_t len = length(self);
+		if (len == -1 && PyErr_Occurred())
+			return nullptr;
+		index += len;
 	}
+	lua_rawgeti(self->lua->state, LUA_REGISTRYINDEX, self->id);
 	self->lua->push(self->lua->table_remove);
+	lua_pushvalue(self->lua->state, -2);
 	lua_pushinteger(self->lua->state, index);
-	lua_call(self->lua->state, 1, 1);
+	if (!self->lua->call(2, 1)) {
+		lua_pop(self->lua->state, 1);
+		return nullptr;
+	}
 	PyObject *ret = self->lua->to_python(-1);
 	lua_pop(self->lua->state, 2);
 	return ret;
 } // }}}
 
-PyObject *Table::len_method(Table *self, PyObject *args) { // {{{
-	PyObject *other;
-	if (!PyArg_ParseTuple(args, "O", &other))
+// }}}
+
+
+// class LuaPool implementation. {{{
+// Python-accessible methods.
+PyMethodDef LuaPool::methods[] = { // {{{
+	{"submit", reinterpret_cast <PyCFunction>(submit_method), METH_VARARGS, "Call a global Lua function on one of the states; return a concurrent.futures.Future"},
+	{"map", reinterpret_cast <PyCFunction>(map_method), METH_VARARGS, "Call a global Lua function for every item, spread over the states; return list of results"},
+	{"acquire", reinterpret_cast <PyCFunction>(acquire_method), METH_NOARGS, "Lease a state for exclusive use by the calling thread"},
+	{"release", reinterpret_cast <PyCFunction>(release_method), METH_VARARGS, "Return a leased state to the pool"},
+	{"stats", reinterpret_cast <PyCFunction>(stats_method), METH_NOARGS, "Get queue wait times and per-state utilisation"},
+	{"close", reinterpret_cast <PyCFunction>(close_method), METH_NOARGS, "Finish queued calls and stop the worker threads"},
+	{nullptr, nullptr, 0, nullptr}
+}; // }}}
+
+PyObject *LuaPool::create(PyTypeObject *type, PyObject *args, PyObject *kwds) { // {{{
+	Py_ssize_t size;
+	PyObject *init = Py_None;
+	PyObject *options = nullptr;
+	char const *keywordnames[] = {"size", "init", "options", nullptr};
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|OO!", const_cast <char **>(keywordnames), &size, &init, &PyDict_Type, &options))
 		return nullptr;
-	lua_rawgeti(self->lua->state, LUA_REGISTRYINDEX, self->id);
-	lua_len(self->lua->state, -1);
-	PyObject *ret = self->lua->to_python(-1);
-	lua_pop(self->lua->state, 2);
-	return ret;
+	if (size < 1) {
+		PyErr_SetString(PyExc_ValueError, "pool size must be at least 1");
+		return nullptr;
+	}
+	LuaPool *self = reinterpret_cast <LuaPool *>(type->tp_alloc(type, 0));
+	if (!self)
+		return nullptr;
+	new (self) LuaPool;
+	self->stopping = false;
+	self->destroy_on_exit = false;
+	self->jobs_done = 0;
+	self->queue_wait = Clock::duration::zero();
+	self->max_queue_wait = Clock::duration::zero();
+
+	// Create the states and initialize them: init is Lua code to run, or a callable that is called with the state.
+	PyObject *noargs = PyTuple_New(0);
+	for (Py_ssize_t i = 0; i < size; ++i) {
+		PyObject *lua = PyObject_Call(reinterpret_cast <PyObject *>(module_state(type)->LuaType), noargs, options);	// New reference.
+		if (!lua)
+			break;
+		self->states.push_back(reinterpret_cast <Lua *>(lua));
+		PyObject *result = nullptr;
+		if (init == Py_None)
+			result = Py_NewRef(Py_None);
+		else if (PyCallable_Check(init))
+			result = PyObject_CallOneArg(init, lua);
+		else
+			result = PyObject_CallMethod(lua, "run", "O", init);
+		if (!result)
+			break;
+		Py_DECREF(result);
+	}
+	Py_DECREF(noargs);
+	if (PyErr_Occurred()) {
+		Py_DECREF(self);
+		return nullptr;
+	}
+	self->leased.assign(size, false);
+	self->calls.assign(size, 0);
+	self->busy.assign(size, Clock::duration::zero());
+	self->started = Clock::now();
+	self->interpreter = PyThreadState_GetInterpreter(PyThreadState_Get());
+
+	// Start one worker per state.
+	for (Py_ssize_t i = 0; i < size; ++i)
+		self->workers.emplace_back(&LuaPool::work, self, size_t(i));
+	return reinterpret_cast <PyObject *>(self);
+} // }}}
+
+// Destructor.
+void LuaPool::dealloc(LuaPool *self) { // {{{
+	if (self->close()) {
+		self->destroy_on_exit = true;
+		return;
+	}
+	destroy(self);
+} // }}}
+
+void LuaPool::destroy(LuaPool *self) { // {{{
+	for (auto lua: self->states)
+		Py_DECREF(lua);
+	self->~LuaPool();
+	PyTypeObject *type = Py_TYPE(self);
+	type->tp_free(reinterpret_cast <PyObject *>(self));
+	Py_DECREF(type);
+} // }}}
+
+size_t LuaPool::lease(size_t preferred) { // {{{
+	size_t index;
+	Py_BEGIN_ALLOW_THREADS
+	{
+		std::unique_lock <std::mutex> lock(mutex);
+		auto free = [this] { return std::find(leased.begin(), leased.end(), false); };
+		state_available.wait(lock, [&] { return free() != leased.end(); });
+		index = preferred < leased.size() && !leased[preferred] ? preferred : free() - leased.begin();
+		leased[index] = true;
+	}
+	Py_END_ALLOW_THREADS
+	return index;
+} // }}}
+
+void LuaPool::unlease(size_t index) { // {{{
+	{
+		std::lock_guard <std::mutex> lock(mutex);
+		leased[index] = false;
+	}
+	state_available.notify_one();
+} // }}}
+
+void LuaPool::work(size_t index) { // {{{
+	// PyGILState_Ensure() only supports the main interpreter, so create a thread state for the pool's interpreter.
+	PyThreadState *thread = PyThreadState_New(interpreter);
+	PyEval_RestoreThread(thread);
+	while (true) {
+		Job job;
+		bool have_job;
+		Py_BEGIN_ALLOW_THREADS
+		{
+			std::unique_lock <std::mutex> lock(mutex);
+			job_available.wait(lock, [this] { return stopping || !jobs.empty(); });
+			// Queued jobs are finished before stopping.
+			have_job = !jobs.empty();
+			if (have_job) {
+				job = jobs.front();
+				jobs.pop_front();
+			}
+		}
+		Py_END_ALLOW_THREADS
+		if (!have_job)
+			break;
+		run_job(job, index);
+	}
+	if (destroy_on_exit)
+		destroy(this);
+	PyThreadState_Clear(thread);
+	PyThreadState_DeleteCurrent();
+} // }}}
+
+void LuaPool::run_job(Job &job, size_t worker) { // {{{
+	Clock::time_point start = Clock::now();
+	size_t index = lease(worker);
+	Clock::time_point leased_at = Clock::now();
+
+	// Call the function.
+	Lua *lua = states[index];
+	PyObject *result;
+	{
+		Lua::Lock lock(lua);
+		int pos = lua_gettop(lua->state);
+		lua_getglobal(lua->state, PyUnicode_AsUTF8(job.name));
+		Py_ssize_t nargs = PyTuple_GET_SIZE(job.args);
+		for (Py_ssize_t a = 0; a < nargs; ++a)
+			lua->push(PyTuple_GET_ITEM(job.args, a));	// Borrowed reference.
+		result = lua->call(nargs, LUA_MULTRET) ? lua->return_values(pos, false) : nullptr;	// New reference.
+	}
+
+	// Update statistics and give the state back.
+	Clock::time_point end = Clock::now();
+	{
+		std::lock_guard <std::mutex> lock(mutex);
+		leased[index] = false;
+		calls[index] += 1;
+		busy[index] += end - leased_at;
+		jobs_done += 1;
+		queue_wait += start - job.queued;
+		max_queue_wait = std::max(max_queue_wait, start - job.queued);
+	}
+	state_available.notify_one();
+
+	// Deliver the result. {{{
+	PyObject *error = nullptr;
+	if (!result) {
+		PyObject *type, *traceback;
+		PyErr_Fetch(&type, &error, &traceback);
+		PyErr_NormalizeException(&type, &error, &traceback);
+		if (traceback)
+			PyException_SetTraceback(error, traceback);
+		Py_XDECREF(type);
+		Py_XDECREF(traceback);
+	}
+	if (job.future) {
+		PyObject *done = result ? PyObject_CallMethod(job.future, "set_result", "O", result) : PyObject_CallMethod(job.future, "set_exception", "O", error);
+		if (!done)
+			PyErr_WriteUnraisable(job.future);
+		Py_XDECREF(done);
+		Py_XDECREF(result);
+		Py_XDECREF(error);
+		Py_DECREF(job.future);
+	}
+	else {
+		if (result)
+			PyList_SET_ITEM(job.batch->results, job.index, result);	// Steals reference.
+		{
+			// Without a GIL, other workers can finish jobs from the same batch at the same time.
+			std::lock_guard <std::mutex> lock(mutex);
+			if (error && !job.batch->error)
+				std::swap(error, job.batch->error);
+			job.batch->remaining -= 1;
+		}
+		Py_XDECREF(error);
+		batch_done.notify_all();
+	}
+	// }}}
+	Py_DECREF(job.name);
+	Py_DECREF(job.args);
+} // }}}
+
+bool LuaPool::enqueue(std::vector <Job> &new_jobs) { // {{{
+	// On success, the references in the jobs are owned by the queue.
+	Clock::time_point now = Clock::now();
+	{
+		std::lock_guard <std::mutex> lock(mutex);
+		if (stopping)
+			return false;
+		for (auto &job: new_jobs) {
+			job.queued = now;
+			jobs.push_back(job);
+		}
+	}
+	job_available.notify_all();
+	return true;
+} // }}}
+
+bool LuaPool::close() { // {{{
+	// Take the workers, so concurrent calls do not join the same thread twice.
+	bool on_worker = false;
+	std::vector <std::thread> stopped;
+	{
+		std::lock_guard <std::mutex> lock(mutex);
+		stopping = true;
+		stopped.swap(workers);
+	}
+	job_available.notify_all();
+	// The workers need the GIL to finish their jobs.
+	Py_BEGIN_ALLOW_THREADS
+	for (auto &worker: stopped) {
+		// A worker cannot join itself; it stops when it returns to work().
+		if (worker.get_id() == std::this_thread::get_id()) {
+			worker.detach();
+			on_worker = true;
+		}
+		else
+			worker.join();
+	}
+	Py_END_ALLOW_THREADS
+	return on_worker;
+} // }}}
+
+PyObject *LuaPool::submit_method(LuaPool *self, PyObject *args) { // {{{
+	Py_ssize_t nargs = PyTuple_GET_SIZE(args);
+	if (nargs < 1 || !PyUnicode_Check(PyTuple_GET_ITEM(args, 0))) {
+		PyErr_SetString(PyExc_TypeError, "submit() needs the name of a function as its first argument");
+		return nullptr;
+	}
+	PyObject *futures = PyImport_ImportModule("concurrent.futures");	// New reference.
+	if (!futures)
+		return nullptr;
+	PyObject *future = PyObject_CallMethod(futures, "Future", nullptr);	// New reference.
+	Py_DECREF(futures);
+	if (!future)
+		return nullptr;
+	PyObject *call_args = PyTuple_GetSlice(args, 1, nargs);	// New reference.
+	if (!call_args) {
+		Py_DECREF(future);
+		return nullptr;
+	}
+	// The job gets its own reference to the future.
+	std::vector <Job> job {Job {Py_NewRef(PyTuple_GET_ITEM(args, 0)), call_args, Py_NewRef(future), nullptr, 0, Clock::time_point()}};
+	if (!self->enqueue(job)) {
+		Py_DECREF(job[0].name);
+		Py_DECREF(call_args);
+		Py_DECREF(future);
+		Py_DECREF(future);
+		PyErr_SetString(PyExc_RuntimeError, "pool has been closed");
+		return nullptr;
+	}
+	return future;
+} // }}}
+
+PyObject *LuaPool::map_method(LuaPool *self, PyObject *args) { // {{{
+	PyObject *name;
+	PyObject *iterable;
+	if (!PyArg_ParseTuple(args, "UO", &name, &iterable))
+		return nullptr;
+	PyObject *items = PySequence_Fast(iterable, "map() needs an iterable");	// New reference.
+	if (!items)
+		return nullptr;
+	Py_ssize_t size = PySequence_Fast_GET_SIZE(items);
+	Batch batch {PyList_New(size), size, nullptr};
+	if (!batch.results) {
+		Py_DECREF(items);
+		return nullptr;
+	}
+	std::vector <Job> batch_jobs;
+	batch_jobs.reserve(size);
+	// Nothing is queued until all jobs have been created, so a failure only needs to drop the jobs so far.
+	auto drop_jobs = [&batch, &batch_jobs] {
+		for (auto &job: batch_jobs) {
+			Py_DECREF(job.name);
+			Py_DECREF(job.args);
+		}
+		Py_DECREF(batch.results);
+	};
+	for (Py_ssize_t i = 0; i < size; ++i) {
+		PyObject *job_args = PyTuple_Pack(1, PySequence_Fast_GET_ITEM(items, i));	// New reference.
+		if (!job_args) {
+			Py_DECREF(items);
+			drop_jobs();
+			return nullptr;
+		}
+		batch_jobs.push_back(Job {Py_NewRef(name), job_args, nullptr, &batch, i, Clock::time_point()});
+	}
+	Py_DECREF(items);
+	if (!self->enqueue(batch_jobs)) {
+		drop_jobs();
+		PyErr_SetString(PyExc_RuntimeError, "pool has been closed");
+		return nullptr;
+	}
+
+	// Wait for the workers to finish the batch.
+	Py_BEGIN_ALLOW_THREADS
+	{
+		std::unique_lock <std::mutex> lock(self->mutex);
+		self->batch_done.wait(lock, [&batch] { return batch.remaining == 0; });
+	}
+	Py_END_ALLOW_THREADS
+	if (batch.error) {
+		PyErr_SetObject(reinterpret_cast <PyObject *>(Py_TYPE(batch.error)), batch.error);
+		Py_DECREF(batch.error);
+		Py_DECREF(batch.results);
+		return nullptr;
+	}
+	return batch.results;
+} // }}}
+
+PyObject *LuaPool::acquire_method(LuaPool *self, PyObject *) { // {{{
+	// Threads get the state they used last time if it is free.
+	std::thread::id thread = std::this_thread::get_id();
+	size_t preferred;
+	{
+		std::lock_guard <std::mutex> lock(self->mutex);
+		auto last = self->affinity.find(thread);
+		preferred = last == self->affinity.end() ? self->states.size() : last->second;
+	}
+	size_t index = self->lease(preferred);
+	{
+		std::lock_guard <std::mutex> lock(self->mutex);
+		self->affinity[thread] = index;
+	}
+	return Py_NewRef(reinterpret_cast <PyObject *>(self->states[index]));
 } // }}}
-// }}}
 
-/*
-class Table: # Using Lua tables from Python. {{{
-	'''Python interface to access a lua table.
-	The table is owned by lua; this class only provides a view to it.'''
-
-	def __init__(self, lua, table = None): # {{{
-		'''Create Python handle for Lua table.
-		If the table is not given as an arugment, it must be pushed to
-		the stack before calling this.'''
-		_dprint('creating lua table', 1)
-		self._lua = lua
-		if table is not None:
-			self._lua._push_luatable(table)
-		self._id = luaL_ref(lua->state, LUA_REGISTRYINDEX)
-		for name, impl in self._lua._ops.items():
-			setattr(self, '__' + name + '__', impl)
-	# }}}
-
-	def __iadd__(self, other): # {{{
-		_dprint('adding objects to lua table', 3)
-		lua_rawgeti(lua->state, LUA_REGISTRYINDEX, ctypes.c_longlong(self._id))
-		lua_len(lua->state, -1)
-		length = self._lua._to_python(-1)
-		lua_settop(lua->state, -2)
-		for item in other:
-			self._lua._push(item)
-			lua_seti(lua->state, -2, ctypes.c_longlong(length + 1))
-			length += 1
-		lua_settop(lua->state, -2)
-		return self
-	# }}}
-
-	def __getitem__(self, key): # {{{
-		_dprint('requesting item of lua table: %s' % key, 3)
-		lua_rawgeti(lua->state, LUA_REGISTRYINDEX, ctypes.c_longlong(self._id))
-		self._lua._push(key)
-		lua_gettable(lua->state, -2)
-		ret = self._lua._to_python(-1)
-		lua_settop(lua->state, -3)
-		if ret is None:
-			raise IndexError('Key %s does not exist in Lua table' % key)
-		return ret
-	# }}}
-
-	def __setitem__(self, key, value): # {{{
-		_dprint('setting item of lua table: %s: %s' % (key, value), 3)
-		lua_rawgeti(lua->state, LUA_REGISTRYINDEX, ctypes.c_longlong(self._id))
-		self._lua._push(key)
-		self._lua._push(value)
-		lua_settable(lua->state, -3)
-		lua_settop(lua->state, -2)
-	# }}}
-
-	def __delitem__(self, key): # {{{
-		_dprint('deleting item of lua table: %s' % key, 3)
-		# Raise IndexError if key doesn't exist: use getitem.
-		self[key]
-		self[key] = None
-	# }}}
-
-	def __contains__(self, key): # {{{
-		_dprint('checking if %s is in lua table' % key, 3)
-		lua_rawgeti(lua->state, LUA_REGISTRYINDEX, ctypes.c_longlong(self._id))
-		lua_pushnil(lua->state)
-		while lua_next(lua->state, -2) != 0:
-			if self._lua._to_python(-2) == key:
-				lua_settop(lua->state, -4)
-				return True
-			lua_settop(lua->state, -2)
-		lua_settop(lua->state, -2)
-		return False
-	# }}}
-
-	def __iter__(self): # {{{
-		_dprint('iterating over lua table', 3)
-		lua_rawgeti(lua->state, LUA_REGISTRYINDEX, ctypes.c_longlong(self._id))
-		lua_pushnil(lua->state)
-		while lua_next(lua->state, -2) != 0:
-			ret = self._lua._to_python(-2)
-			lua_settop(lua->state, -2)
-			ref = luaL_ref(lua->state, LUA_REGISTRYINDEX)
-			try:
-				lua_settop(lua->state, -2)
-				yield ret
-				lua_rawgeti(lua->state, LUA_REGISTRYINDEX, ctypes.c_longlong(self._id))
-				lua_rawgeti(lua->state, LUA_REGISTRYINDEX, ctypes.c_longlong(ref))
-			finally:
-				luaL_unref(lua->state, LUA_REGISTRYINDEX, ref)
-		lua_settop(lua->state, -2)
-	# }}}
-
-	def dict(self, allow_unknown = False): # {{{
-		'Get a copy of the table as a dict'
-		_dprint('get dict from lua table %s' % self._id, 1)
-		ret = {}
-		lua_rawgeti(lua->state, LUA_REGISTRYINDEX, ctypes.c_longlong(self._id))
-		lua_pushnil(lua->state)
-		while lua_next(lua->state, -2) != 0:
-			ret[self._lua._to_python(-2, allow_unknown)] = self._lua._to_python(-1, allow_unknown)
-			lua_settop(lua->state, -2)
-		lua_settop(lua->state, -2)
-		return ret
-	# }}}
-
-	def list(self): # {{{
-		'Get a copy of the table, which must be a sequence, as a list. note that table[1] becomes list[0].'
-		_dprint('get list from lua table %s' % self._id, 1)
-		lua_rawgeti(lua->state, LUA_REGISTRYINDEX, ctypes.c_longlong(self._id))
-		lua_len(lua->state, -1)
-		length = self._lua._to_python(-1)
-		lua_settop(lua->state, -2)
-		ret = [None] * length
-		for i in range(1, length + 1):
-			lua_rawgeti(lua->state, -1, ctypes.c_longlong(i))
-			ret[i - 1] = self._lua._to_python(-1)
-			lua_settop(lua->state, -2)
-		lua_settop(lua->state, -2)
-		return ret
-	# }}}
-
-# }}}
-*/
+PyObject *LuaPool::release_method(LuaPool *self, PyObject *args) { // {{{
+	PyObject *lua;
+	if (!PyArg_ParseTuple(args, "O!", self->states.front()->types->LuaType, &lua))
+		return nullptr;
+	auto found = std::find(self->states.begin(), self->states.end(), reinterpret_cast <Lua *>(lua));
+	if (found == self->states.end()) {
+		PyErr_SetString(PyExc_ValueError, "state does not belong to this pool");
+		return nullptr;
+	}
+	self->unlease(found - self->states.begin());
+	Py_RETURN_NONE;
+} // }}}
+
+PyObject *LuaPool::stats_method(LuaPool *self, PyObject *) { // {{{
+	// Copy the numbers, so no Python objects are created while holding the mutex.
+	std::vector <Py_ssize_t> calls;
+	std::vector <Clock::duration> busy;
+	Py_ssize_t jobs_done, queued;
+	Clock::duration queue_wait, max_queue_wait;
+	{
+		std::lock_guard <std::mutex> lock(self->mutex);
+		calls = self->calls;
+		busy = self->busy;
+		jobs_done = self->jobs_done;
+		queued = self->jobs.size();
+		queue_wait = self->queue_wait;
+		max_queue_wait = self->max_queue_wait;
+	}
+	typedef std::chrono::duration <double> Seconds;
+	double elapsed = Seconds(Clock::now() - self->started).count();
+	PyObject *states = PyList_New(calls.size());
+	if (!states)
+		return nullptr;
+	for (size_t i = 0; i < calls.size(); ++i) {
+		double seconds = Seconds(busy[i]).count();
+		PyList_SET_ITEM(states, i, Py_BuildValue("{sn sd sd}", "calls", calls[i], "busy", seconds, "utilisation", elapsed > 0 ? seconds / elapsed : 0.));
+	}
+	return Py_BuildValue("{sn sn sn sd sd sd sN}",
+			"size", Py_ssize_t(calls.size()),
+			"jobs", jobs_done,
+			"queued", queued,
+			"queue_wait", Seconds(queue_wait).count(),
+			"mean_queue_wait", jobs_done > 0 ? Seconds(queue_wait).count() / jobs_done : 0.,
+			"max_queue_wait", Seconds(max_queue_wait).count(),
+			"states", states);
+} // }}}
+
+PyObject *LuaPool::close_method(LuaPool *self, PyObject *) { // {{{
+	self->close();
+	Py_RETURN_NONE;
+} // }}}
+// }}}
 
 // vim: set foldmethod=marker :
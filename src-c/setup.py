@@ -1,7 +1,11 @@
 #!/usr/bin/python3
 
+import os
 from setuptools import setup, Extension
 
+# Set PYTHON_LUA_STATS=1 to compile in the counters for Lua.stats().
+macros = [('PYTHON_LUA_STATS', '1')] if os.environ.get('PYTHON_LUA_STATS') else []
+
 module = Extension('lua',
 	sources = [
 		'module.cc',
@@ -10,6 +14,7 @@ module = Extension('lua',
 		'setup.py',
 	],
 	language = 'c++',
+	define_macros = macros,
 	extra_compile_args = ['-std=c++20', '-I/usr/include/lua5.4', '-llua5.4'],
 )
 